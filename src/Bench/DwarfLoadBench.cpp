@@ -0,0 +1,48 @@
+//
+// Created by Will Gulian on 1/16/21.
+//
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <vector>
+
+#include "../DwarfInfo.h"
+
+/// Times DwarfLoader::load() on a binary, for comparing loader changes:
+///   DwarfLoadBench <binary> [runs]
+/// The phase timers of each load are printed as well. No symbol index is read or written.
+int main(int argc, char **argv) {
+  if (argc < 2) {
+    std::cout << "usage: " << argv[0] << " <binary> [runs]\n";
+    return 1;
+  }
+
+  int runs = argc > 2 ? std::max(1, atoi(argv[2])) : 5;
+  std::vector<long long> times;
+
+  for (int run = 0; run < runs; run++) {
+    auto start = std::chrono::steady_clock::now();
+
+    auto loader = DwarfLoader::openFile(argv[1]);
+    if (loader.is_error()) {
+      std::cout << "failed to open " << argv[1] << ": " << loader.as_error().toStdString() << "\n";
+      return 1;
+    }
+
+    auto loaded = loader.as_value().load();
+    if (loaded.is_error()) {
+      std::cout << "failed to load " << argv[1] << ": " << loaded.as_error().toStdString() << "\n";
+      return 1;
+    }
+
+    auto elapsed = std::chrono::steady_clock::now() - start;
+    times.push_back(std::chrono::duration_cast<std::chrono::milliseconds>(elapsed).count());
+  }
+
+  std::sort(times.begin(), times.end());
+  std::cout << "load " << argv[1] << ": best " << times.front() << " ms, median " << times[times.size() / 2]
+            << " ms over " << runs << " runs\n";
+  return 0;
+}
@@ -3,6 +3,7 @@
 //
 
 #include <iostream>
+#include <thread>
 
 extern "C" {
   // #include "dwarf.h"
@@ -11,8 +12,20 @@ extern "C" {
 
 #include "DebugTable.h"
 #include "DwarfInfo.h"
+#include "SymbolIndex.h"
 
 
+DebugTable::~DebugTable() {
+  {
+    std::lock_guard<std::mutex> _guard(unitQueueLock);
+    stopUnitLoader = true;
+  }
+  unitQueueCondition.notify_all();
+
+  if (unitLoader.joinable())
+    unitLoader.join();
+}
+
 QString DebugTable::loadFile(const QString &file, bool replace) {
 
   auto loader = DwarfLoader::openFile(file.toUtf8().data());
@@ -25,15 +38,181 @@ QString DebugTable::loadFile(const QString &file, bool replace) {
     return QString();
   }
 
-  auto loaded = loader.as_value().load();
+  // An unchanged build is read back from its symbol index instead of parsing the DWARF again.
+  auto indexPath = SymbolIndex::pathFor(loader.as_value().buildId);
+  auto indexed = loader.as_value().loadIndex(indexPath);
+  bool fromIndex = indexed.is_ok();
+  bool lazy = !fromIndex && lazyLoad;
+
+  auto loaded = fromIndex ? std::move(indexed) : lazy ? loader.as_value().loadLazy() : loader.as_value().load();
   if (loaded.is_error()) {
     return loaded.as_error();
   }
 
+  if (fromIndex) {
+    std::cout << "using symbol index " << indexPath.toStdString() << "\n";
+  } else if (!lazy && !SymbolIndex::write(indexPath, loaded.as_value())) {
+    // a lazily loaded file only knows part of its symbols, it gets an index once loaded fully.
+    std::cout << "failed to write symbol index for " << file.toStdString() << "\n";
+  }
+
   std::lock_guard<std::mutex> _guard(lock);
-  loadedFiles.insert({ buildId, std::move(loaded).into_value() });
+  auto [it, inserted] = loadedFiles.insert({ buildId, std::move(loaded).into_value() });
+  if (inserted) {
+    // anything cached for this build id came from a different file.
+    resolveCache.erase(buildId);
+  }
 
   std::cout << "loaded build id 0x" << std::hex << buildId << std::hex << "\n";
 
   return QString();
 }
+
+/// Abstract origins of the inlines in resolved that are not linked to their function, because
+/// the unit defining it was not parsed yet.
+static void collect_unlinked_origins(const ResolvedAddress &resolved, std::vector<Dwarf_Off> &origins) {
+  for (uint32_t i = 0; i < resolved.inlineCount; i++) {
+    if (!resolved.inlines[i]->origin_fn)
+      origins.push_back(resolved.inlines[i]->origin_offset);
+  }
+}
+
+ResolvedAddress DebugTable::resolve(uint64_t buildId, uint64_t pc) {
+  auto dwarf = loadedFiles.find(buildId);
+  if (dwarf == loadedFiles.end())
+    return ResolvedAddress{};
+
+  auto [it, inserted] = resolveCache[buildId].try_emplace(pc);
+  if (inserted) {
+    it->second = dwarf->second.resolve(pc);
+
+    std::vector<Dwarf_Off> origins;
+    collect_unlinked_origins(it->second, origins);
+    if (!it->second.function || !origins.empty())
+      requestUnits(buildId, dwarf->second, it->second.function ? std::vector<uint64_t>() : std::vector<uint64_t>{pc},
+                   origins);
+  }
+
+  return it->second;
+}
+
+void DebugTable::resolveAll(uint64_t buildId, const std::vector<uint64_t> &pcs) {
+  auto dwarf = loadedFiles.find(buildId);
+  if (dwarf == loadedFiles.end())
+    return;
+
+  auto &cache = resolveCache[buildId];
+
+  std::vector<uint64_t> missing;
+  for (auto pc : pcs) {
+    if (cache.try_emplace(pc).second)
+      missing.push_back(pc);
+  }
+
+  if (missing.empty())
+    return;
+
+  // only worth spinning up threads for whole captures.
+  unsigned threads = missing.size() >= 65536 ? std::thread::hardware_concurrency() : 1;
+  auto resolved = dwarf->second.resolveBatch(missing, threads);
+  std::vector<uint64_t> unresolved;
+  std::vector<Dwarf_Off> origins;
+  for (size_t i = 0; i < missing.size(); i++) {
+    cache[missing[i]] = resolved[i];
+    if (!resolved[i].function)
+      unresolved.push_back(missing[i]);
+    collect_unlinked_origins(resolved[i], origins);
+  }
+
+  if (!unresolved.empty() || !origins.empty())
+    requestUnits(buildId, dwarf->second, unresolved, origins);
+}
+
+ResolvedAddress DebugTable::cached(uint64_t buildId, uint64_t pc) const {
+  auto build = resolveCache.find(buildId);
+  if (build == resolveCache.end())
+    return ResolvedAddress{};
+
+  auto it = build->second.find(pc);
+  return it != build->second.end() ? it->second : ResolvedAddress{};
+}
+
+void DebugTable::setOnUnitsLoaded(std::function<void(uint64_t buildId)> callback) {
+  std::lock_guard<std::mutex> _guard(unitQueueLock);
+  onUnitsLoaded = std::move(callback);
+}
+
+void DebugTable::requestUnits(uint64_t buildId, DwarfInfo &dwarf, const std::vector<uint64_t> &pcs,
+                              const std::vector<Dwarf_Off> &origins) {
+  auto units = dwarf.lazyUnits();
+  if (!units)
+    return;
+
+  auto indices = units->request(pcs);
+  auto originUnits = units->requestDies(origins);
+  indices.insert(indices.end(), originUnits.begin(), originUnits.end());
+  if (indices.empty())
+    return;
+
+  {
+    std::lock_guard<std::mutex> _guard(unitQueueLock);
+    if (!unitLoader.joinable())
+      unitLoader = std::thread(&DebugTable::unitLoaderLoop, this);
+
+    unitQueue.push_back(UnitRequest{buildId, std::move(units), std::move(indices)});
+  }
+  unitQueueCondition.notify_one();
+}
+
+void DebugTable::unitLoaderLoop() {
+  std::unique_lock<std::mutex> queueGuard(unitQueueLock);
+
+  while (true) {
+    unitQueueCondition.wait(queueGuard, [&] { return stopUnitLoader || !unitQueue.empty(); });
+    if (stopUnitLoader)
+      return;
+
+    auto request = std::move(unitQueue.front());
+    unitQueue.pop_front();
+
+    // take everything queued for the same file, so its address map is only rebuilt once.
+    for (auto it = unitQueue.begin(); it != unitQueue.end();) {
+      if (it->units == request.units) {
+        request.indices.insert(request.indices.end(), it->indices.begin(), it->indices.end());
+        it = unitQueue.erase(it);
+      } else {
+        ++it;
+      }
+    }
+
+    queueGuard.unlock();
+
+    auto parsed = request.units->parse(request.indices);
+    bool added = false;
+
+    if (parsed.is_error()) {
+      std::cout << "failed to load compilation units: " << parsed.as_error().toStdString() << "\n";
+    } else {
+      std::lock_guard<std::mutex> _guard(lock);
+
+      // the file may have been loaded again in the meantime.
+      auto dwarf = loadedFiles.find(request.buildId);
+      if (dwarf != loadedFiles.end() && dwarf->second.lazyUnits() == request.units) {
+        dwarf->second.addUnits(std::move(parsed).into_value());
+        resolveCache.erase(request.buildId);
+        added = true;
+      }
+    }
+
+    if (added) {
+      std::cout << "loaded " << request.indices.size() << " compilation units for build id 0x" << std::hex
+                << request.buildId << std::dec << "\n";
+    }
+
+    queueGuard.lock();
+
+    // called under unitQueueLock so setOnUnitsLoaded() can wait for it.
+    if (added && onUnitsLoaded)
+      onUnitsLoaded(request.buildId);
+  }
+}
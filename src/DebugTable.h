@@ -5,26 +5,82 @@
 #ifndef TRACEVIEWER2_DEBUGTABLE_H
 #define TRACEVIEWER2_DEBUGTABLE_H
 
+#include <atomic>
+#include <condition_variable>
 #include <cstdint>
+#include <deque>
+#include <functional>
 #include <mutex>
+#include <thread>
 #include <unordered_map>
+#include <vector>
 
 #include "DwarfInfo.h"
 
 class DebugTable {
+  /// Resolved pcs by build id, then pc. Inline chains point into the build's DwarfInfo.
+  /// function is null for pcs that could not be resolved. Only touched while holding lock.
+  std::unordered_map<uint64_t, std::unordered_map<uint64_t, ResolvedAddress>> resolveCache;
+
+  struct UnitRequest {
+    uint64_t buildId;
+    std::shared_ptr<DwarfInfo::LazyUnits> units;
+    std::vector<uint32_t> indices;
+  };
+
+  /// Parses requested compilation units of lazily loaded files in the background.
+  std::thread unitLoader;
+  std::mutex unitQueueLock;
+  std::condition_variable unitQueueCondition;
+  std::deque<UnitRequest> unitQueue;
+  bool stopUnitLoader { false };
+  // guarded by unitQueueLock, see setOnUnitsLoaded().
+  std::function<void(uint64_t buildId)> onUnitsLoaded;
 
 public:
   std::unordered_map<uint64_t, DwarfInfo> loadedFiles;
   std::mutex lock;
 
+  /// Files without a symbol index are loaded with DwarfLoader::loadLazy(), so only the
+  /// compilation units that sampled pcs land in get parsed. Applies to following loads.
+  std::atomic<bool> lazyLoad { false };
+
   DebugTable() = default;
 
+  ~DebugTable();
+
+  /// callback is called on the unit loader thread, without lock held, after units were added
+  /// to a build. Anything resolved for that build before should be resolved again. Once this
+  /// returns the previous callback is neither running nor called again, pass nullptr to clear it.
+  void setOnUnitsLoaded(std::function<void(uint64_t buildId)> callback);
+
   QString loadFile(const QString &file, bool replace = false);
 
   bool hasBuildId(uint64_t id) {
     return loadedFiles.find(id) != loadedFiles.end();
   }
 
+  /// Memoized DwarfInfo::resolve(). Results are kept until the build is loaded again.
+  /// Returns an empty result if the build is not loaded or the pc is not in any function.
+  /// The caller must hold lock.
+  ResolvedAddress resolve(uint64_t buildId, uint64_t pc);
+
+  /// Resolves every pc that is not cached yet in one DwarfInfo::resolveBatch() sweep,
+  /// so that following resolve() calls are cache hits. The caller must hold lock.
+  void resolveAll(uint64_t buildId, const std::vector<uint64_t> &pcs);
+
+  /// What resolve() cached for pc, empty if nothing is. Never modifies the cache.
+  /// The caller must hold lock.
+  ResolvedAddress cached(uint64_t buildId, uint64_t pc) const;
+
+private:
+  /// Queues the units of a lazily loaded build that cover unresolved pcs or define the abstract
+  /// origins of inlines that are not linked yet. The caller must hold lock.
+  void requestUnits(uint64_t buildId, DwarfInfo &dwarf, const std::vector<uint64_t> &pcs,
+                    const std::vector<Dwarf_Off> &origins = {});
+
+  void unitLoaderLoop();
+
 };
 
 
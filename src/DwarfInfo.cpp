@@ -2,7 +2,15 @@
 // Created by Will Gulian on 11/26/20.
 //
 
+#include <atomic>
+#include <chrono>
+#include <iterator>
+#include <map>
 #include <memory>
+#include <mutex>
+#include <numeric>
+#include <optional>
+#include <thread>
 #include <vector>
 #include <unordered_map>
 #include <unordered_set>
@@ -10,6 +18,7 @@
 #include <unistd.h>
 
 #include "DwarfInfo.h"
+#include "SymbolIndex.h"
 #include "libdwarf.h"
 #include "dwarf.h"
 #include "libelf/libelf.h"
@@ -22,12 +31,18 @@ struct DieStackEntry {
   Dwarf_Off die_offset = 0;
   const char *name = nullptr;
 
-  std::vector<Dwarf_Half> attribute_codes{};
-
   ConcreteFunctionInfo *function = nullptr;
   InlinedFunctionInfo *inlined_function = nullptr;
 };
 
+/// A DIE whose children walk_dies() is visiting.
+struct DieWalkFrame {
+  Dwarf_Die die = nullptr;
+  Dwarf_Half tag = 0;
+  // false for the root, which belongs to the caller.
+  bool owned = false;
+};
+
 void print_ranges(const std::vector<std::pair<uint64_t, uint64_t>> &ranges) {
   std::cout << "[";
 
@@ -93,6 +108,13 @@ struct CompilationUnitHeader {
   Dwarf_Half header_cu_type;
 };
 
+/// One open libdwarf handle on the debug file.
+struct DwarfHandle {
+  int fd = -1;
+  Elf *elf = nullptr;
+  Dwarf_Debug debug_info = nullptr;
+};
+
 struct CompilationUnitInfo {
   Dwarf_Off range_lists_base = 0;
 
@@ -101,6 +123,32 @@ struct CompilationUnitInfo {
   bool has_ranges_attr = false;
 };
 
+/// Prints how long a phase of loading took once the next one starts or it goes out of scope.
+class PhaseTimer {
+  const char *phase;
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+  void print() {
+    auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start);
+    std::cout << "load: " << phase << " took " << std::dec << elapsed.count() / 1000.0 << " ms" << std::endl;
+  }
+
+public:
+  explicit PhaseTimer(const char *phase) : phase(phase) {}
+
+  PhaseTimer(const PhaseTimer &other) = delete;
+
+  ~PhaseTimer() {
+    print();
+  }
+
+  void next(const char *nextPhase) {
+    print();
+    phase = nextPhase;
+    start = std::chrono::steady_clock::now();
+  }
+};
+
 }
 
 
@@ -139,7 +187,7 @@ void InlinedFunctionInfo::dump() {
     std::cout << "  ";
   std::cout << "  Inlined ";
   if (origin_fn) {
-    std::cout << origin_fn->full_name.toStdString() << "\n";
+    std::cout << origin_fn->full_name << "\n";
   } else {
     std::cout << "(no name)\n";
   }
@@ -163,6 +211,10 @@ void InlinedFunctionInfo::dump() {
 }
 
 QString InlinedFunctionInfo::getFullName() const {
+  // lazily loaded files may not have parsed the unit of the origin yet.
+  if (!origin_fn)
+    return QString("inlined 0x") + QString::number(origin_offset, 16);
+
   return origin_fn->getFullName();
 }
 
@@ -171,7 +223,7 @@ bool InlinedFunctionInfo::containsAddress(uint64_t address) const {
 }
 
 void ConcreteFunctionInfo::dump() {
-  std::cout << full_name.toStdString() << "\n";
+  std::cout << full_name << "\n";
 
   if (!ranges.empty()) {
     std::cout << "  Ranges: ";
@@ -194,13 +246,46 @@ bool ConcreteFunctionInfo::containsAddress(uint64_t address) const {
 struct DwarfInfo::Internal {
   int fd = 0;
   Elf *elf = nullptr;
+
+  // set when loaded from a SymbolIndex, function names point into its mapping.
+  std::unique_ptr<QFile> symbolIndex;
+
+  // set when loaded lazily, holds the handle the remaining units are parsed with.
+  std::shared_ptr<LazyUnits> lazyUnits;
 };
 
+/// Sets linkageId of every function. Ids are handed out per distinct linkage name for the
+/// life of the process, names are copied so ids outlive the files they came from.
+static void assign_linkage_ids(const std::vector<std::unique_ptr<ConcreteFunctionInfo>> &functions) {
+  static std::mutex lock;
+  static SymbolStringPool names;
+  static std::unordered_map<std::string_view, uint32_t> ids;
+
+  const std::lock_guard<std::mutex> g(lock);
+  for (auto &function : functions) {
+    auto it = ids.find(function->linkageName);
+    if (it == ids.end()) {
+      // keyed by the pooled copy, the function's view dies with its file.
+      it = ids.emplace(names.intern(function->linkageName), static_cast<uint32_t>(ids.size())).first;
+    }
+    function->linkageId = it->second;
+  }
+}
+
 DwarfInfo::DwarfInfo(
         QString &&file, std::vector<uint8_t> &&buildId, std::vector<std::unique_ptr<ConcreteFunctionInfo>> &&functions,
-        DwarfInfo::LineTable &&lineTable)
+        DwarfInfo::LineTable &&lineTable, SymbolStringPool &&strings)
         : file(std::move(file)), loaded_time(std::time(nullptr)), buildId(std::move(buildId)),
-          functions(std::move(functions)), lineTable(std::move(lineTable)), internal(std::make_unique<Internal>()) {}
+          strings(std::move(strings)), functions(std::move(functions)), internal(std::make_unique<Internal>()),
+          lineFiles(std::move(lineTable.files)) {
+  for (auto &function : this->functions) {
+    function->buildId = getBuildId();
+  }
+  assign_linkage_ids(this->functions);
+
+  buildLineMap(std::move(lineTable.lines));
+  buildAddressMap();
+}
 
 
 DwarfInfo::~DwarfInfo() {
@@ -292,8 +377,158 @@ static std::vector<uint8_t> find_build_id(Elf *elf) {
   return std::vector<uint8_t>();
 }
 
+static void collectRangeBoundaries(const std::vector<std::pair<uint64_t, uint64_t>> &ranges,
+                                   const std::vector<std::unique_ptr<InlinedFunctionInfo>> &inlines,
+                                   std::vector<uint64_t> &boundaries) {
+  for (auto [low, high] : ranges) {
+    boundaries.push_back(low);
+    boundaries.push_back(high);
+  }
+
+  for (auto &inline_func : inlines) {
+    collectRangeBoundaries(inline_func->ranges, inline_func->inline_functions, boundaries);
+  }
+}
+
+void DwarfInfo::buildAddressMap() {
+  addressMap = AddressMap();
+
+  // Nothing changes in between two range boundaries, so resolving the start of each
+  // elementary interval with the slow path gives the answer for all of it.
+  std::vector<uint64_t> boundaries;
+  for (auto &function : functions) {
+    collectRangeBoundaries(function->ranges, function->inline_functions, boundaries);
+  }
+
+  std::sort(boundaries.begin(), boundaries.end());
+  boundaries.erase(std::unique(boundaries.begin(), boundaries.end()), boundaries.end());
+
+  std::map<std::vector<InlinedFunctionInfo *>, uint32_t> chainOffsets;
+  auto &map = addressMap;
+
+  for (size_t i = 0; i + 1 < boundaries.size(); i++) {
+    auto low = boundaries[i];
+    auto high = boundaries[i + 1];
+
+    auto func = resolveSlow(low);
+    if (!func)
+      continue;
+
+    auto &[function, inlines] = *func;
+    auto [chainIt, inserted] = chainOffsets.try_emplace(inlines, static_cast<uint32_t>(map.inlines.size()));
+    if (inserted) {
+      map.inlines.insert(map.inlines.end(), inlines.begin(), inlines.end());
+    }
+
+    // merge with the previous interval if it is adjacent and resolves the same.
+    if (!map.starts.empty() && map.ends.back() == low && map.functions.back() == function &&
+        map.inlineOffsets.back() == chainIt->second && map.inlineCounts.back() == inlines.size()) {
+      map.ends.back() = high;
+      continue;
+    }
+
+    map.starts.push_back(low);
+    map.ends.push_back(high);
+    map.functions.push_back(function);
+    map.inlineOffsets.push_back(chainIt->second);
+    map.inlineCounts.push_back(static_cast<uint32_t>(inlines.size()));
+  }
+}
+
+ResolvedAddress DwarfInfo::resolve(uint64_t address) const {
+  auto &map = addressMap;
+  if (map.starts.empty() || address < map.starts.front())
+    return ResolvedAddress{};
+
+  // Branchless binary search for the last interval starting at or before address.
+  const uint64_t *base = map.starts.data();
+  size_t count = map.starts.size();
+  while (count > 1) {
+    auto half = count / 2;
+    base = base[half] <= address ? base + half : base;
+    count -= half;
+  }
+
+  auto index = static_cast<size_t>(base - map.starts.data());
+  if (address >= map.ends[index])
+    return ResolvedAddress{};
+
+  return intervalAt(index);
+}
+
+/// Like std::partition_point, but gallops forward from first. Sweeping ascending keys
+/// this way costs O(log distance) per key rather than O(log size).
+template<typename It, typename Pred>
+static It gallopPartitionPoint(It first, It last, Pred pred) {
+  size_t step = 1;
+  while (step < static_cast<size_t>(last - first) && pred(first[step])) {
+    first += step;
+    step *= 2;
+  }
+
+  return std::partition_point(first, first + std::min(step, static_cast<size_t>(last - first)), pred);
+}
+
+/// Calls func(order, begin, end) for contiguous slices of the addresses in sorted order,
+/// where order holds the indices of addresses sorted by address.
+template<typename Func>
+static void sweepSorted(const std::vector<uint64_t> &addresses, unsigned threads, Func func) {
+  std::vector<size_t> order(addresses.size());
+  std::iota(order.begin(), order.end(), 0);
+  std::sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+    return addresses[a] < addresses[b];
+  });
+
+  threads = std::max(1u, std::min<unsigned>(threads, order.size() / 1024 + 1));
+  if (threads == 1) {
+    func(order, 0, order.size());
+    return;
+  }
+
+  std::vector<std::thread> workers;
+  for (unsigned i = 0; i < threads; i++) {
+    workers.emplace_back(func, std::cref(order), order.size() * i / threads, order.size() * (i + 1) / threads);
+  }
+  for (auto &worker : workers) {
+    worker.join();
+  }
+}
+
+std::vector<ResolvedAddress> DwarfInfo::resolveBatch(const std::vector<uint64_t> &addresses, unsigned threads) const {
+  std::vector<ResolvedAddress> results(addresses.size());
+  auto &starts = addressMap.starts;
+
+  sweepSorted(addresses, threads, [&](const std::vector<size_t> &order, size_t begin, size_t end) {
+    auto it = starts.cbegin();
+    for (size_t i = begin; i < end; i++) {
+      auto address = addresses[order[i]];
+
+      // one past the last interval starting at or before address.
+      it = gallopPartitionPoint(it, starts.cend(), [&](uint64_t start) { return start <= address; });
+      if (it == starts.cbegin())
+        continue;
+
+      auto index = static_cast<size_t>(it - starts.cbegin()) - 1;
+      if (address < addressMap.ends[index])
+        results[order[i]] = intervalAt(index);
+    }
+  });
+
+  return results;
+}
+
 std::optional<std::pair<ConcreteFunctionInfo *, std::vector<InlinedFunctionInfo *>>>
 DwarfInfo::resolve_address(uint64_t address) const {
+  auto resolved = resolve(address);
+  if (!resolved.function)
+    return {};
+
+  return {std::make_pair(resolved.function, std::vector<InlinedFunctionInfo *>(
+          resolved.inlines, resolved.inlines + resolved.inlineCount))};
+}
+
+std::optional<std::pair<ConcreteFunctionInfo *, std::vector<InlinedFunctionInfo *>>>
+DwarfInfo::resolveSlow(uint64_t address) const {
 
   auto func_it = std::lower_bound(functions.cbegin(), functions.cend(), address, [](const auto &func, const auto addr) {
     if (func->ranges.empty())
@@ -334,41 +569,196 @@ DwarfInfo::resolve_address(uint64_t address) const {
       }
     }
 
-    // FIXME hack
-    func_it->get()->buildId = getBuildId();
-
     return {std::make_pair(func_it->get(), std::move(inline_stack))};
   }
 }
 
-std::optional<std::pair<QString, uint32_t>> DwarfInfo::getLineForAddress(uint64_t address) const {
+static void writeVarint(std::vector<uint8_t> &bytes, uint64_t value) {
+  while (value >= 0x80) {
+    bytes.push_back(static_cast<uint8_t>(value | 0x80));
+    value >>= 7;
+  }
+  bytes.push_back(static_cast<uint8_t>(value));
+}
 
-  auto func_it = std::lower_bound(lineTable.lines.cbegin(), lineTable.lines.cend(), address, [](const auto &func, const auto addr) {
-    return func.address < addr;
-  });
+static uint64_t readVarint(const uint8_t *&pos) {
+  uint64_t value = 0;
+  int shift = 0;
+  while (*pos & 0x80) {
+    value |= static_cast<uint64_t>(*pos++ & 0x7f) << shift;
+    shift += 7;
+  }
+  return value | (static_cast<uint64_t>(*pos++) << shift);
+}
 
-  if (func_it == lineTable.lines.cend())
-    return {};
+static uint64_t zigzag(int64_t value) {
+  return (static_cast<uint64_t>(value) << 1) ^ static_cast<uint64_t>(value >> 63);
+}
+
+static int64_t unzigzag(uint64_t value) {
+  return static_cast<int64_t>(value >> 1) ^ -static_cast<int64_t>(value & 1);
+}
 
-  if ((func_it+1) != lineTable.lines.cend() && (func_it+1)->address == address) {
-    std::cout << "========\n";
-    auto func_it2 = func_it;
-    while (func_it2 != lineTable.lines.cend() && func_it2->address == address) {
-      std::cout << "line: " + lineTable.files.at(func_it2->fileIndex).name.toStdString() << " : " << std::dec
-                << (int) (func_it2->line) << std::endl;
-      ++func_it2;
+void DwarfInfo::buildLineMap(std::vector<LineInfo> &&lines) {
+  lineMap = LineMap();
+
+  auto byAddress = [](auto &a, auto &b) {
+    return a.address < b.address;
+  };
+  if (!std::is_sorted(lines.begin(), lines.end(), byAddress))
+    std::stable_sort(lines.begin(), lines.end(), byAddress);
+
+  // lookups only ever return the first row of an address.
+  lines.erase(std::unique(lines.begin(), lines.end(), [](auto &a, auto &b) {
+    return a.address == b.address;
+  }), lines.end());
+
+  auto &map = lineMap;
+  map.count = lines.size();
+  map.blockStarts.reserve(lines.size() / LineMap::kBlockSize + 1);
+  map.blockOffsets.reserve(lines.size() / LineMap::kBlockSize + 1);
+
+  LineInfo prev;
+  for (size_t i = 0; i < lines.size(); i++) {
+    auto &line = lines[i];
+    if (i % LineMap::kBlockSize == 0) {
+      map.blockStarts.push_back(line.address);
+      map.blockOffsets.push_back(static_cast<uint32_t>(map.bytes.size()));
+      prev = LineInfo{line.address, 0, 0};
+    }
+
+    writeVarint(map.bytes, line.address - prev.address);
+    writeVarint(map.bytes, zigzag(static_cast<int64_t>(line.fileIndex) - prev.fileIndex));
+    writeVarint(map.bytes, zigzag(static_cast<int64_t>(line.line) - prev.line));
+    prev = line;
+  }
+
+  map.bytes.shrink_to_fit();
+}
+
+/// Walks the rows of a LineMap forward, for lookups of ascending addresses.
+class DwarfInfo::LineCursor {
+  const LineMap &map;
+  size_t block = 0;
+  // rows left in the current block after `current`.
+  size_t remaining = 0;
+  const uint8_t *pos = nullptr;
+  LineInfo current;
+  bool valid = false;
+
+  void decodeNext() {
+    current.address += readVarint(pos);
+    current.fileIndex += static_cast<int32_t>(unzigzag(readVarint(pos)));
+    current.line += static_cast<uint32_t>(unzigzag(readVarint(pos)));
+  }
+
+  void seekBlock(size_t index) {
+    block = index;
+    pos = map.bytes.data() + map.blockOffsets[index];
+    remaining = std::min(LineMap::kBlockSize, map.count - index * LineMap::kBlockSize) - 1;
+    current = LineInfo{map.blockStarts[index], 0, 0};
+    decodeNext();
+    valid = true;
+  }
+
+  bool step() {
+    if (remaining > 0) {
+      remaining--;
+      decodeNext();
+    } else if (block + 1 < map.blockStarts.size()) {
+      seekBlock(block + 1);
+    } else {
+      valid = false;
+    }
+    return valid;
+  }
+
+public:
+  explicit LineCursor(const LineMap &map) : map(map) {
+    if (map.count > 0)
+      seekBlock(0);
+  }
+
+  /// The first row at or after address, or null if there is none. Addresses of successive
+  /// calls must not decrease.
+  const LineInfo *lowerBound(uint64_t address) {
+    if (!valid)
+      return nullptr;
+    if (current.address >= address)
+      return &current;
+
+    // skip straight to the last block starting at or before address.
+    auto &starts = map.blockStarts;
+    auto it = gallopPartitionPoint(starts.cbegin() + block + 1, starts.cend(), [&](uint64_t start) {
+      return start <= address;
+    });
+    auto index = static_cast<size_t>(it - starts.cbegin()) - 1;
+    if (index != block)
+      seekBlock(index);
+
+    while (current.address < address) {
+      if (!step())
+        return nullptr;
     }
-    std::cout << "========\n";
+    return &current;
+  }
+
+  /// The row after the one returned last, or null at the end.
+  const LineInfo *next() {
+    return valid && step() ? &current : nullptr;
   }
+};
+
+std::vector<DwarfInfo::LineInfo> DwarfInfo::decodeLines() const {
+  std::vector<LineInfo> lines;
+  lines.reserve(lineMap.count);
+
+  LineCursor cursor(lineMap);
+  for (auto line = cursor.lowerBound(0); line; line = cursor.next()) {
+    lines.push_back(*line);
+  }
+  return lines;
+}
+
+std::optional<std::pair<QString, uint32_t>> DwarfInfo::lineResult(const LineInfo &line) const {
+  if (line.fileIndex < 0 || static_cast<size_t>(line.fileIndex) >= lineFiles.size())
+    return std::make_pair(QString(), line.line);
+  return std::make_pair(toQString(lineFiles[line.fileIndex].name), line.line);
+}
+
+std::optional<std::pair<QString, uint32_t>> DwarfInfo::getLineForAddress(uint64_t address) const {
+  LineCursor cursor(lineMap);
+  auto line = cursor.lowerBound(address);
+  if (!line)
+    return {};
 
-  return std::make_pair(lineTable.files.at(func_it->fileIndex).name, func_it->line);
+  return lineResult(*line);
+}
+
+std::vector<std::optional<std::pair<QString, uint32_t>>>
+DwarfInfo::getLinesForAddresses(const std::vector<uint64_t> &addresses, unsigned threads) const {
+  std::vector<std::optional<std::pair<QString, uint32_t>>> results(addresses.size());
+
+  sweepSorted(addresses, threads, [&](const std::vector<size_t> &order, size_t begin, size_t end) {
+    LineCursor cursor(lineMap);
+    for (size_t i = begin; i < end; i++) {
+      // same lookup as getLineForAddress()
+      auto line = cursor.lowerBound(addresses[order[i]]);
+      if (!line)
+        break;
+
+      results[order[i]] = lineResult(*line);
+    }
+  });
+
+  return results;
 }
 
 std::pair<QString, bool> DwarfInfo::symbolicate(uint64_t address) const {
   auto funcs = resolve_address(address);
   if (funcs) {
     auto &[main_func, inlines] = *funcs;
-    return std::make_pair(main_func->full_name, true);
+    return std::make_pair(toQString(main_func->full_name), true);
   }
 
   std::cout << "failed to symbolicate address = 0x" << std::hex << address << std::dec << std::endl;
@@ -390,67 +780,82 @@ static QString handle_error(Dwarf_Debug debug_info, Dwarf_Error error) {
 #define TRY_ERROR(type, debugInfo, res, error) do {if ((res) == DW_DLV_ERROR)return Result<type, QString>::with_error(handle_error(debugInfo, error));}while(0)
 
 
-struct DieWalkInfo {
-  Dwarf_Debug debug_info;
-  bool is_info;
-
-  // callback "args"
-  int level;
-  int sibling_index;
-};
-
-template<typename Func>
+/// Walks the DIEs under root depth first with an explicit stack, reusing `stack` so nothing is
+/// allocated per DIE. enter(die, tag, level) is called on the way down and returns whether to
+/// visit the children, exit(die, tag) is called after the children of every DIE that was entered
+/// that way. Only root is visited from the top level, not its siblings.
+template<typename Enter, typename Exit>
 static Result<int, QString>
-walkDebugInfo(Dwarf_Debug debugInfo, DieWalkInfo &info, Dwarf_Die die, Func func, int level = 0, int sibling_index = 0) {
-  info.level = level;
-  info.sibling_index = sibling_index;
-  func(info, die, false);
-
-  Dwarf_Die child_die;
+walk_dies(Dwarf_Debug debug_info, bool is_info, Dwarf_Die root, std::vector<DieWalkFrame> &stack,
+          Enter enter, Exit exit) {
   Dwarf_Error error;
-  int res = dwarf_child(die, &child_die, &error);
-  TRY_ERROR(int, debugInfo, res, error);
-  if (res == DW_DLV_OK) {
-    auto result = walkDebugInfo(debugInfo, info, child_die, func, level + 1, 0);
-
-    dwarf_dealloc_die(child_die);
-    child_die = nullptr;
-
-    if (!result.is_ok()) {
-      return std::move(result);
+  stack.clear();
+
+  auto fail = [&](Dwarf_Die die, bool owned) {
+    if (owned)
+      dwarf_dealloc_die(die);
+    for (auto &frame : stack) {
+      if (frame.owned)
+        dwarf_dealloc_die(frame.die);
     }
-  }
+    stack.clear();
+    return Result<int, QString>::with_error(handle_error(debug_info, error));
+  };
 
-  info.level = level;
-  info.sibling_index = sibling_index;
-  func(info, die, true);
+  Dwarf_Die die = root;
+  bool owned = false;
 
-  if (sibling_index == 0) {
-    bool our_die = false;
-    for (int i = 1;; i++) {
-      Dwarf_Die next_die;
-      res = dwarf_siblingof_b(info.debug_info, die, info.is_info, &next_die, &error);
-      TRY_ERROR(int, debugInfo, res, error);
-      if (res == DW_DLV_NO_ENTRY)
-        break;
+  while (true) {
+    Dwarf_Half tag = 0;
+    if (dwarf_tag(die, &tag, &error) == DW_DLV_ERROR)
+      return fail(die, owned);
+
+    bool descend = enter(die, tag, static_cast<int>(stack.size()));
+    if (descend) {
+      Dwarf_Die child = nullptr;
+      int res = dwarf_child(die, &child, &error);
+      if (res == DW_DLV_ERROR)
+        return fail(die, owned);
+
+      if (res == DW_DLV_OK) {
+        stack.push_back(DieWalkFrame{die, tag, owned});
+        die = child;
+        owned = true;
+        continue;
+      }
 
-      if (our_die) {
-        dwarf_dealloc_die(die);
-        die = nullptr;
+      exit(die, tag);
+    }
+
+    // done with die and its children, move on to the next sibling or back up to the parent.
+    while (true) {
+      if (stack.empty()) {
+        if (owned)
+          dwarf_dealloc_die(die);
+        return Result<int, QString>::with_value(0);
       }
 
-      die = next_die;
-      our_die = true;
+      Dwarf_Die sibling = nullptr;
+      int res = dwarf_siblingof_b(debug_info, die, is_info, &sibling, &error);
+      if (res == DW_DLV_ERROR)
+        return fail(die, owned);
 
-      auto result = walkDebugInfo(debugInfo, info, die, func, level, i);
+      if (owned)
+        dwarf_dealloc_die(die);
 
-      if (!result.is_ok()) {
-        return std::move(result);
+      if (res == DW_DLV_OK) {
+        die = sibling;
+        owned = true;
+        break;
       }
+
+      auto frame = stack.back();
+      stack.pop_back();
+      die = frame.die;
+      owned = frame.owned;
+      exit(die, frame.tag);
     }
   }
-
-  return Result<int, QString>::with_value(0);
 }
 
 template<typename Func>
@@ -546,328 +951,512 @@ build_ranges(Dwarf_Debug debug_info, CompilationUnitInfo &cu_info, Dwarf_Die die
   }
 }
 
-static Result<std::vector<std::unique_ptr<ConcreteFunctionInfo>>, QString> scan_debug_info(Dwarf_Debug debug_info, DwarfInfo::LineTable &lineTable) {
-  CompilationUnitHeader header{};
+static CompilationUnitInfo read_cu_info(Dwarf_Debug debug_info, Dwarf_Die cu_die) {
+  Dwarf_Error error;
+  int res;
+
+  CompilationUnitInfo cu_info;
+
+  res = forEachAttribute(debug_info, cu_die, &error, [&](auto i, Dwarf_Attribute attr) {
+    Dwarf_Half at_code;
+    int res = dwarf_whatattr(attr, &at_code, &error);
+    assert(res == DW_DLV_OK);
+
+    switch (at_code) {
+      case DW_AT_rnglists_base:
+      case DW_AT_GNU_ranges_base: {
+        res = dwarf_global_formref(attr, &cu_info.range_lists_base, &error);
+        assert(res == DW_DLV_OK);
+        break;
+      }
+      case DW_AT_low_pc: {
+        res = dwarf_lowpc(cu_die, &cu_info.default_base_address, &error);
+        assert(res == DW_DLV_OK);
+        break;
+      }
+      case DW_AT_ranges: {
+        cu_info.has_ranges_attr = true;
+        break;
+      }
+      default:
+        break;
+    }
+  });
+  assert(res != DW_DLV_ERROR);
+
+  if (!cu_info.has_ranges_attr) {
+    cu_info.default_base_address = 0;
+  }
+
+  return cu_info;
+}
+
+/// The file a DW_AT_call_file in compilation unit cu_index refers to, empty if there is none.
+static std::string_view
+call_file_name(const DwarfInfo::LineTable &lineTable, int cu_index, Dwarf_Unsigned file_index) {
+  auto it = lineTable.unitFiles.find(cu_index);
+  if (file_index == 0 || it == lineTable.unitFiles.end())
+    return std::string_view("");
+
+  // a unit's files are numbered from 1 in the order they were added.
+  auto index = it->second + file_index - 1;
+  if (index >= lineTable.files.size())
+    return std::string_view("");
+
+  auto &file = lineTable.files[index];
+  if (file.cu_index != cu_index || file.file_index != static_cast<Dwarf_Signed>(file_index))
+    return std::string_view("");
+  return file.name;
+}
+
+/// A string attribute of die, null if it has none.
+static const char *die_string(Dwarf_Debug debug_info, Dwarf_Die die, Dwarf_Half at_code) {
+  Dwarf_Error error;
+  Dwarf_Attribute attr = nullptr;
+  if (dwarf_attr(die, at_code, &attr, &error) != DW_DLV_OK)
+    return nullptr;
+
+  char *str = nullptr;
+  dwarf_formstring(attr, &str, &error);
+  dwarf_dealloc(debug_info, attr, DW_DLA_ATTR);
+  return str;
+}
+
+/// An unsigned attribute of die, 0 if it has none.
+static Dwarf_Unsigned die_udata(Dwarf_Debug debug_info, Dwarf_Die die, Dwarf_Half at_code) {
+  Dwarf_Error error;
+  Dwarf_Attribute attr = nullptr;
+  if (dwarf_attr(die, at_code, &attr, &error) != DW_DLV_OK)
+    return 0;
+
+  Dwarf_Unsigned value = 0;
+  dwarf_formudata(attr, &value, &error);
+  dwarf_dealloc(debug_info, attr, DW_DLA_ATTR);
+  return value;
+}
+
+/// Whether a block covers any code, blocks without only hold variables and types.
+static bool die_has_code(Dwarf_Die die) {
+  Dwarf_Error error;
+  Dwarf_Bool has = false;
+  if (dwarf_hasattr(die, DW_AT_low_pc, &has, &error) == DW_DLV_OK && has)
+    return true;
+  return dwarf_hasattr(die, DW_AT_ranges, &has, &error) == DW_DLV_OK && has;
+}
+
+/// Tags scan_cu() keeps on its stack, see DieStackEntry.
+static bool is_scope_tag(Dwarf_Half tag) {
+  switch (tag) {
+    case DW_TAG_compile_unit:
+    case DW_TAG_namespace:
+    case DW_TAG_structure_type:
+    case DW_TAG_union_type:
+    case DW_TAG_class_type:
+    case DW_TAG_subprogram:
+    case DW_TAG_inlined_subroutine:
+      return true;
+    default:
+      return false;
+  }
+}
+
+/// Scans one compilation unit for functions and their inline trees. Inlines are not linked
+/// to their origin yet, that needs the functions of every CU.
+static Result<std::vector<std::unique_ptr<ConcreteFunctionInfo>>, QString>
+scan_cu(Dwarf_Debug debug_info, Dwarf_Die cu_die, int cu_index, const DwarfInfo::LineTable &lineTable,
+        SymbolStringPool &strings) {
   bool is_info = true;
   constexpr auto dump_tags = false;
 
+  // reused for every function, names are only copied once they are interned.
+  std::string full_name;
+
   std::vector<std::unique_ptr<ConcreteFunctionInfo>> functions;
-  Dwarf_Error error;
+  int res;
 
-  for (int cu_index = 0;; cu_index++) {
-    // iterate through the compilation units...
-    // returns NO_ENTRY and resets state after progressing all CUs
+  auto cu_info = read_cu_info(debug_info, cu_die);
 
-    int res = dwarf_next_cu_header_d(
-            debug_info, is_info, &header.header_length, &header.version_stamp,
-            &header.abbrev_offset, &header.address_size, &header.offset_size,
-            &header.extension_size, &header.signature, &header.type_offset,
-            &header.next_cu_header, &header.header_cu_type, &error);
-    TRY_ERROR(std::vector<std::unique_ptr<ConcreteFunctionInfo>>, debug_info, res, error);
+  std::vector<DieWalkFrame> walk_stack;
+  walk_stack.reserve(32);
+  std::vector<DieStackEntry> die_stack;
+  die_stack.reserve(32);
 
-    if (res == DW_DLV_NO_ENTRY)
-      break; // no more entries, exit.
+  auto die_name = [&](Dwarf_Die die) {
+    Dwarf_Error err;
+    char *attr_name = nullptr;
+    res = dwarf_diename(die, &attr_name, &err);
+    if (res == DW_DLV_NO_ENTRY) {
+      get_name_from_abstract_origin(debug_info, is_info, die, &attr_name, &err);
+    }
+    return attr_name;
+  };
 
-    Dwarf_Die cu_die;
-    res = dwarf_siblingof_b(debug_info, nullptr, is_info, &cu_die, &error);
-    TRY_ERROR(std::vector<std::unique_ptr<ConcreteFunctionInfo>>, debug_info, res, error);
-    if (res == DW_DLV_NO_ENTRY)
-      continue;
+  if (dump_tags) {
+    walk_dies(debug_info, is_info, cu_die, walk_stack, [&](Dwarf_Die die, Dwarf_Half tag, int level) {
+      Dwarf_Error err;
 
-    CompilationUnitInfo cu_info;
+      const char *tag_name;
+      dwarf_get_TAG_name(tag, &tag_name);
 
-    res = forEachAttribute(debug_info, cu_die, &error, [&](auto i, Dwarf_Attribute attr) {
-      Dwarf_Half at_code;
-      int res = dwarf_whatattr(attr, &at_code, &error);
-      assert(res == DW_DLV_OK);
+      for (int i = 0; i < level; i++)
+        std::cout << " ";
+      std::cout << tag_name;
 
-      switch (at_code) {
-        case DW_AT_rnglists_base:
-        case DW_AT_GNU_ranges_base: {
-          res = dwarf_global_formref(attr, &cu_info.range_lists_base, &error);
-          assert(res == DW_DLV_OK);
-          break;
-        }
-        case DW_AT_low_pc: {
-          res = dwarf_lowpc(cu_die, &cu_info.default_base_address, &error);
-          assert(res == DW_DLV_OK);
-          break;
-        }
-        case DW_AT_ranges: {
-          cu_info.has_ranges_attr = true;
-          break;
-        }
-        default:
-          break;
-      }
-    });
-    assert(res != DW_DLV_ERROR);
+      std::cout << " [";
 
-    if (!cu_info.has_ranges_attr) {
-      cu_info.default_base_address = 0;
-    }
+      res = forEachAttribute(debug_info, die, &err, [&](auto i, Dwarf_Attribute attr) {
+        if (i > 0)
+          std::cout << ", ";
 
-    std::vector<DieStackEntry> die_stack;
+        Dwarf_Half at_code;
+        dwarf_whatattr(attr, &at_code, &err);
 
-    DieWalkInfo walkInfo{};
-    walkInfo.debug_info = debug_info;
-    walkInfo.is_info = is_info;
+        const char *at_name = "";
+        dwarf_get_AT_name(at_code, &at_name);
 
-    if (dump_tags) {
-      walkDebugInfo(debug_info, walkInfo, cu_die, [&](DieWalkInfo &info, Dwarf_Die die, bool is_exit) {
-        Dwarf_Error err;
+        std::cout << at_name;
+      });
+      assert(res != DW_DLV_ERROR);
 
-        Dwarf_Off offset;
-        res = dwarf_dieoffset(die, &offset, &err);
-        assert(res == DW_DLV_OK);
+      std::cout << "]\n";
 
-        Dwarf_Half tag;
-        res = dwarf_tag(die, &tag, &err);
-        assert(res == DW_DLV_OK);
+      auto attr_name = die_name(die);
+      for (int j = 0; j < level + 2; j++)
+        std::cout << " ";
+      std::cout << "AT_name = " << (attr_name ? attr_name : "") << "\n";
 
-        if (is_exit) {
-          return;
-        }
+      return true;
+    }, [](Dwarf_Die, Dwarf_Half) {});
+  }
 
-        DieStackEntry die_info;
-        die_info.tag = tag;
-        die_info.die_offset = offset;
+  auto enter = [&](Dwarf_Die die, Dwarf_Half tag, int level) {
+    Dwarf_Error err;
+
+    switch (tag) {
+      case DW_TAG_compile_unit:
+      case DW_TAG_namespace:
+      case DW_TAG_structure_type:
+      case DW_TAG_union_type:
+      case DW_TAG_class_type:
+      case DW_TAG_subprogram:
+      case DW_TAG_inlined_subroutine:
+        break;
+      case DW_TAG_lexical_block:
+      case DW_TAG_try_block:
+      case DW_TAG_catch_block:
+        // not a scope of their own, only walked for the inlines and local classes in them.
+        return die_has_code(die);
+      default:
+        // types, variables, parameters, call sites, ... never hold a function.
+        return false;
+    }
 
-        const char *tag_name;
-        dwarf_get_TAG_name(tag, &tag_name);
+    DieStackEntry die_info;
+    die_info.tag = tag;
+    res = dwarf_dieoffset(die, &die_info.die_offset, &err);
+    assert(res == DW_DLV_OK);
 
-        for (int i = 0; i < info.level; i++)
-          std::cout << " ";
-        std::cout << tag_name;
+    switch (tag) {
+      case DW_TAG_subprogram: {
+        die_info.name = die_name(die);
+
+        full_name.clear();
+        for (auto &ns : die_stack) {
+          switch (ns.tag) {
+            case DW_TAG_namespace:
+            case DW_TAG_structure_type:
+            case DW_TAG_union_type:
+            case DW_TAG_class_type:
+              if (ns.name)
+                full_name += ns.name;
+              full_name += "::";
+            default:
+              break;
+          }
+        }
 
-        std::cout << " [";
+        if (die_info.name)
+          full_name += die_info.name;
 
-        res = forEachAttribute(debug_info, die, &err, [&](auto i, Dwarf_Attribute attr) {
-          if (i > 0)
-            std::cout << ", ";
+        auto attr_linkage_name = die_string(debug_info, die, DW_AT_linkage_name);
 
-          Dwarf_Half at_code;
-          dwarf_whatattr(attr, &at_code, &err);
+        auto function = std::make_unique<ConcreteFunctionInfo>();
+        function->name = strings.intern(die_info.name ? die_info.name : "");
+        function->die_offset = die_info.die_offset;
+        function->full_name = strings.intern(full_name);
+        function->linkageName = strings.intern(attr_linkage_name ? attr_linkage_name : "");
+        function->ranges = build_ranges(debug_info, cu_info, die);
 
-          die_info.attribute_codes.push_back(at_code);
+        die_info.function = function.get();
+        functions.push_back(std::move(function));
+        break;
+      }
+      case DW_TAG_inlined_subroutine: {
 
-          const char *at_name = "";
-          dwarf_get_AT_name(at_code, &at_name);
+        Dwarf_Attribute ab_attr = nullptr;
+        Dwarf_Off ab_offset = 0;
 
-          std::cout << at_name;
-        });
-        assert(res != DW_DLV_ERROR);
+        res = dwarf_attr(die, DW_AT_abstract_origin, &ab_attr, &err);
+        assert(res == DW_DLV_OK);
 
-        std::cout << "]\n";
+        res = dwarf_global_formref(ab_attr, &ab_offset, &err);
+        assert(res == DW_DLV_OK);
+        dwarf_dealloc(debug_info, ab_attr, DW_DLA_ATTR);
 
-        char *attr_name = nullptr;
-        res = dwarf_diename(die, &attr_name, &err);
-        if (res == DW_DLV_NO_ENTRY) {
-          get_name_from_abstract_origin(debug_info, is_info, die, &attr_name, &err);
+        int depth = 1;
+        for (auto &entry : die_stack) {
+          if (entry.tag == DW_TAG_inlined_subroutine)
+            depth++;
         }
 
-        die_info.name = attr_name;
+        auto file_index = die_udata(debug_info, die, DW_AT_call_file);
+        auto file_line = die_udata(debug_info, die, DW_AT_call_line);
 
-        for (int j = 0; j < info.level + 2; j++)
-          std::cout << " ";
-        std::cout << "AT_name = " << (attr_name ? attr_name : "") << "\n";
+        auto function = std::make_unique<InlinedFunctionInfo>();
+        function->die_offset = die_info.die_offset;
+        function->depth = depth;
+        function->origin_offset = ab_offset;
+        function->ranges = build_ranges(debug_info, cu_info, die);
+        function->sourceLine = std::make_pair(call_file_name(lineTable, cu_index, file_index),
+                                              static_cast<uint32_t>(file_line));
 
-      });
-    }
+        die_info.inlined_function = function.get();
 
-    walkDebugInfo(debug_info, walkInfo, cu_die, [&](DieWalkInfo &info, Dwarf_Die die, bool is_exit) {
-      Dwarf_Error err;
+        assert(!die_stack.empty());
+        auto &parent = *die_stack.rbegin();
+        if (parent.tag == DW_TAG_subprogram)
+          parent.function->inline_functions.push_back(std::move(function));
+        else if (parent.tag == DW_TAG_inlined_subroutine)
+          parent.inlined_function->inline_functions.push_back(std::move(function));
+        else
+          assert(0 && "unexpected tag");
 
-      Dwarf_Off offset;
-      res = dwarf_dieoffset(die, &offset, &err);
-      assert(res == DW_DLV_OK);
-
-      Dwarf_Half tag;
-      res = dwarf_tag(die, &tag, &err);
-      assert(res == DW_DLV_OK);
-
-      switch (tag) {
-        case DW_TAG_compile_unit:
-        case DW_TAG_namespace:
-        case DW_TAG_structure_type:
-        case DW_TAG_union_type:
-        case DW_TAG_class_type:
-        case DW_TAG_enumeration_type:
-        case DW_TAG_subprogram:
-        case DW_TAG_inlined_subroutine:
-          break;
-        default:
-          return;
+        break;
       }
+      default:
+        // only named for the functions in it.
+        die_info.name = die_name(die);
+        break;
+    }
 
-      if (is_exit) {
-        die_stack.pop_back();
-        return;
-      }
+    die_stack.push_back(die_info);
+    return true;
+  };
 
-      DieStackEntry die_info;
-      die_info.tag = tag;
-      die_info.die_offset = offset;
+  auto exit = [&](Dwarf_Die, Dwarf_Half tag) {
+    if (is_scope_tag(tag))
+      die_stack.pop_back();
+  };
 
-      const char *tag_name;
-      dwarf_get_TAG_name(tag, &tag_name);
+  auto walked = walk_dies(debug_info, is_info, cu_die, walk_stack, enter, exit);
+  if (walked.is_error())
+    return Result<std::vector<std::unique_ptr<ConcreteFunctionInfo>>, QString>::with_error(std::move(walked).into_error());
 
-      if (dump_tags) {
-        for (int i = 0; i < info.level; i++)
-          std::cout << " ";
-        std::cout << tag_name;
-      }
+  return Result<std::vector<std::unique_ptr<ConcreteFunctionInfo>>, QString>::with_value(std::move(functions));
+}
 
-      if (dump_tags) {
-        std::cout << " [";
-      }
+/// The line table of one compilation unit, file indices are relative to its own files.
+static Result<DwarfInfo::LineTable, QString>
+cu_line_table(Dwarf_Debug debug_info, Dwarf_Die cu_die, int cu_index, SymbolStringPool &strings) {
+  DwarfInfo::LineTable lineTable;
+  Dwarf_Error error;
+  int res;
 
-      char *attr_linkage_name = nullptr;
-      Dwarf_Unsigned file_index = 0;
-      Dwarf_Unsigned file_line = 0; // optional not needed because 0 is the non-existent state.
+  Dwarf_Unsigned line_version = 0;
+  Dwarf_Small table_type = 0;
+  Dwarf_Line_Context line_context = nullptr;
 
-      res = forEachAttribute(debug_info, die, &err, [&](auto i, Dwarf_Attribute attr) {
-        if (dump_tags) {
-          if (i > 0)
-            std::cout << ", ";
-        }
+  res = dwarf_srclines_b(cu_die, &line_version,
+                         &table_type, &line_context, &error);
+  TRY_ERROR(DwarfInfo::LineTable, debug_info, res, error);
 
-        Dwarf_Half at_code;
-        dwarf_whatattr(attr, &at_code, &err);
+  if (table_type != 1) {
+    std::cout << std::dec << "unexpected table_type = " << (int) table_type << ", line_version = " << line_version
+              << std::endl;
+    return Result<DwarfInfo::LineTable, QString>::with_value(std::move(lineTable));
+  }
 
-        die_info.attribute_codes.push_back(at_code);
+  char **srcFiles = nullptr;
+  Dwarf_Signed srcFilesCount = 0;
 
-        if (dump_tags) {
-          const char *at_name = "";
-          dwarf_get_AT_name(at_code, &at_name);
+  res = dwarf_srcfiles(cu_die, &srcFiles, &srcFilesCount, &error);
+  if (res != DW_DLV_OK) {
+    return Result<DwarfInfo::LineTable, QString>::with_error(handle_error(debug_info, error));
+  }
 
-          std::cout << at_name;
-        }
+  lineTable.unitFiles[cu_index] = 0;
+  for (Dwarf_Signed j = 0; j < srcFilesCount; j++) {
+    char *name = srcFiles[j];
+    // std::cout << "file: " << name << std::endl;
 
-        switch(at_code) {
-          case DW_AT_linkage_name:
-            dwarf_formstring(attr, &attr_linkage_name, &err);
-            break;
-          case DW_AT_call_file:
-            dwarf_formudata(attr, &file_index, &err);
-            break;
-          case DW_AT_call_line:
-            dwarf_formudata(attr, &file_line, &err);
-            break;
-          default:
-            break;
-        }
-      });
-      assert(res == DW_DLV_OK);
+    lineTable.files.push_back(DwarfInfo::LineFileInfo{cu_index, j + 1, strings.intern(name), 0});
 
-      if (dump_tags) {
-        std::cout << "]\n";
-      }
+    dwarf_dealloc(debug_info, name, DW_DLA_STRING);
+  }
 
-      char *attr_name = nullptr;
-      res = dwarf_diename(die, &attr_name, &err);
-      if (res == DW_DLV_NO_ENTRY) {
-        get_name_from_abstract_origin(debug_info, is_info, die, &attr_name, &err);
-      }
+  dwarf_dealloc(debug_info, srcFiles, DW_DLA_LIST);
+  srcFiles = nullptr;
 
-      die_info.name = attr_name;
+  Dwarf_Line *linebuf = 0;
+  Dwarf_Signed linecount = 0;
 
-      if (dump_tags) {
-        for (int j = 0; j < info.level + 2; j++)
-          std::cout << " ";
-        std::cout << "AT_name = " << (attr_name ? attr_name : "") << "\n";
-      }
+  res = dwarf_srclines_from_linecontext(line_context, &linebuf, &linecount, &error);
+  if (res != DW_DLV_OK) {
+    dwarf_srclines_dealloc_b(line_context);
+    line_context = 0;
+    return Result<DwarfInfo::LineTable, QString>::with_error(handle_error(debug_info, error));
+  }
 
-      auto ranges = build_ranges(debug_info, cu_info, die);
-
-      switch (tag) {
-        case DW_TAG_subprogram: {
-          QString full_name;
-          for (auto &ns : die_stack) {
-            switch (ns.tag) {
-              case DW_TAG_namespace:
-              case DW_TAG_structure_type:
-              case DW_TAG_union_type:
-              case DW_TAG_class_type:
-              case DW_TAG_enumeration_type:
-                full_name += ns.name;
-                full_name += "::";
-              default:
-                break;
-            }
-          }
+  for (int i = 0; i < linecount; ++i) {
+    Dwarf_Addr lineaddr = 0;
+    Dwarf_Unsigned filenum = 0;
+    Dwarf_Unsigned lineno = 0;
 
-          full_name += die_info.name;
+    res = dwarf_lineno(linebuf[i], &lineno, &error);
+    TRY_ERROR(DwarfInfo::LineTable, debug_info, res, error);
+
+    res = dwarf_line_srcfileno(linebuf[i], &filenum, &error);
+    TRY_ERROR(DwarfInfo::LineTable, debug_info, res, error);
 
-          auto function = std::make_unique<ConcreteFunctionInfo>();
-          function->name = die_info.name;
-          function->die_offset = die_info.die_offset;
-          function->full_name = full_name;
-          if (attr_linkage_name)
-            function->linkageName = QString(attr_linkage_name);
-          function->ranges = ranges;
+    assert(filenum != 0 && "filenum was zero");
+    if (filenum) {
+      filenum -= 1;
+    }
+    res = dwarf_lineaddr(linebuf[i], &lineaddr, &error);
+    TRY_ERROR(DwarfInfo::LineTable, debug_info, res, error);
 
-          die_info.function = function.get();
-          functions.push_back(std::move(function));
-          break;
-        }
-        case DW_TAG_inlined_subroutine: {
+    int32_t fileIndex = -1;
+    if (filenum < lineTable.files.size()) {
+      fileIndex = (int32_t) filenum;
+    }
 
-          Dwarf_Attribute ab_attr = nullptr;
-          Dwarf_Off ab_offset = 0;
+    lineTable.lines.push_back(DwarfInfo::LineInfo{lineaddr, fileIndex, (uint32_t) lineno});
+  }
 
-          res = dwarf_attr(die, DW_AT_abstract_origin, &ab_attr, &err);
-          assert(res == DW_DLV_OK);
+  dwarf_srclines_dealloc_b(line_context);
 
-          res = dwarf_global_formref(ab_attr, &ab_offset, &err);
-          assert(res == DW_DLV_OK);
+  return Result<DwarfInfo::LineTable, QString>::with_value(std::move(lineTable));
+}
 
-          int depth = 1;
-          for (auto &entry : die_stack) {
-            if (entry.tag == DW_TAG_inlined_subroutine)
-              depth++;
-          }
+/// Offsets of every compilation unit's DIE, in the order they appear in .debug_info.
+static Result<std::vector<Dwarf_Off>, QString> enumerate_cus(Dwarf_Debug debug_info) {
+  CompilationUnitHeader header{};
+  bool is_info = true;
 
-          auto function = std::make_unique<InlinedFunctionInfo>();
-          function->die_offset = die_info.die_offset;
-          function->depth = depth;
-          function->origin_offset = ab_offset;
-          function->ranges = ranges;
-
-
-          QString fileName("");
-          if (file_index != 0) {
-            for (auto &file : lineTable.files) {
-              if (file.cu_index == cu_index && file.file_index == static_cast<Dwarf_Signed>(file_index)) {
-                fileName = file.name;
-                break;
-              }
-            }
-          }
-          function->sourceLine = std::make_pair(std::move(fileName), static_cast<uint32_t>(file_line));
+  std::vector<Dwarf_Off> offsets;
+  Dwarf_Error error;
+
+  while (true) {
+    // returns NO_ENTRY and resets state after progressing all CUs
+    int res = dwarf_next_cu_header_d(
+            debug_info, is_info, &header.header_length, &header.version_stamp,
+            &header.abbrev_offset, &header.address_size, &header.offset_size,
+            &header.extension_size, &header.signature, &header.type_offset,
+            &header.next_cu_header, &header.header_cu_type, &error);
+    TRY_ERROR(std::vector<Dwarf_Off>, debug_info, res, error);
 
-          die_info.inlined_function = function.get();
+    if (res == DW_DLV_NO_ENTRY)
+      break; // no more entries, exit.
 
-          assert(!die_stack.empty());
-          auto &parent = *die_stack.rbegin();
-          if (parent.tag == DW_TAG_subprogram)
-            parent.function->inline_functions.push_back(std::move(function));
-          else if (parent.tag == DW_TAG_inlined_subroutine)
-            parent.inlined_function->inline_functions.push_back(std::move(function));
-          else
-            assert(0 && "unexpected tag");
+    Dwarf_Die cu_die;
+    res = dwarf_siblingof_b(debug_info, nullptr, is_info, &cu_die, &error);
+    TRY_ERROR(std::vector<Dwarf_Off>, debug_info, res, error);
+    if (res == DW_DLV_NO_ENTRY)
+      continue;
 
-          break;
-        }
-        default:
-          break;
+    Dwarf_Off offset;
+    res = dwarf_dieoffset(cu_die, &offset, &error);
+    TRY_ERROR(std::vector<Dwarf_Off>, debug_info, res, error);
+
+    offsets.push_back(offset);
+    dwarf_dealloc_die(cu_die);
+  }
+
+  return Result<std::vector<Dwarf_Off>, QString>::with_value(std::move(offsets));
+}
+
+/// Opens another libdwarf handle on the same file. A Dwarf_Debug must only be used by one
+/// thread at a time, so every loader thread gets its own.
+static std::optional<DwarfHandle> open_handle(const QString &file) {
+  DwarfHandle handle;
+  handle.fd = open(file.toUtf8().data(), O_RDONLY);
+  if (handle.fd < 0)
+    return std::nullopt;
+
+  handle.elf = elf_begin(handle.fd, ELF_C_READ, nullptr);
+  if (!handle.elf) {
+    close(handle.fd);
+    return std::nullopt;
+  }
+
+  Dwarf_Error error;
+  if (dwarf_elf_init(handle.elf, 0, nullptr, nullptr, &handle.debug_info, &error) != DW_DLV_OK) {
+    elf_end(handle.elf);
+    close(handle.fd);
+    return std::nullopt;
+  }
+
+  return handle;
+}
+
+/// Closes every handle but the first, which belongs to the DwarfLoader.
+static void close_worker_handles(std::vector<DwarfHandle> &handles) {
+  Dwarf_Error error;
+  for (size_t i = 1; i < handles.size(); i++) {
+    dwarf_finish(handles[i].debug_info, &error);
+    elf_end(handles[i].elf);
+    close(handles[i].fd);
+  }
+  handles.resize(std::min<size_t>(handles.size(), 1));
+}
+
+/// Calls func(debug_info, cu_die, cu_index, worker) for every CU with one thread per handle,
+/// handing out CUs in order. worker is the index of the handle. func must only write to
+/// state owned by that cu_index or worker.
+/// Returns the error of the first CU that failed, if any.
+template<typename Func>
+static std::optional<QString>
+for_each_cu_parallel(std::vector<DwarfHandle> &handles, const std::vector<Dwarf_Off> &cuOffsets, Func func) {
+  std::atomic<size_t> next{0};
+  std::vector<std::optional<QString>> errors(cuOffsets.size());
+
+  auto worker = [&](size_t worker) {
+    auto &handle = handles[worker];
+    for (size_t i = next++; i < cuOffsets.size(); i = next++) {
+      Dwarf_Die cu_die;
+      Dwarf_Error error;
+      int res = dwarf_offdie_b(handle.debug_info, cuOffsets[i], true, &cu_die, &error);
+      if (res == DW_DLV_ERROR) {
+        errors[i] = handle_error(handle.debug_info, error);
+        continue;
       }
+      if (res == DW_DLV_NO_ENTRY)
+        continue;
 
-      die_stack.push_back(die_info);
+      errors[i] = func(handle.debug_info, cu_die, static_cast<int>(i), worker);
+      dwarf_dealloc_die(cu_die);
+    }
+  };
 
-    });
+  // the calling thread takes the first handle.
+  std::vector<std::thread> threads;
+  for (size_t t = 1; t < handles.size(); t++) {
+    threads.emplace_back(worker, t);
+  }
+  worker(0);
+  for (auto &thread : threads) {
+    thread.join();
   }
 
+  for (auto &error : errors) {
+    if (error)
+      return error;
+  }
+  return std::nullopt;
+}
+
+/// Sorts functions for binary search and links every inline function to its definition.
+static void sort_and_link_functions(std::vector<std::unique_ptr<ConcreteFunctionInfo>> &functions) {
   {
     // sort functions for binary search later
 
@@ -905,119 +1494,100 @@ static Result<std::vector<std::unique_ptr<ConcreteFunctionInfo>>, QString> scan_
     }
 
   }
-
-//  for (auto &func : functions) {
-//    func->dump();
-//  }
-
-  return Result<std::vector<std::unique_ptr<ConcreteFunctionInfo>>, QString>::with_value(std::move(functions));
 }
 
-static Result<DwarfInfo::LineTable, QString> generate_line_table(Dwarf_Debug debug_info) {
-  CompilationUnitHeader header{};
-  bool is_info = true;
-
-  DwarfInfo::LineTable lineTable;
-  Dwarf_Error error;
-
-  for (int cu_index = 0;; cu_index++) {
-    // iterate through the compilation units...
-    // returns NO_ENTRY and resets state after progressing all CUs
-
-    int res = dwarf_next_cu_header_d(
-            debug_info, is_info, &header.header_length, &header.version_stamp,
-            &header.abbrev_offset, &header.address_size, &header.offset_size,
-            &header.extension_size, &header.signature, &header.type_offset,
-            &header.next_cu_header, &header.header_cu_type, &error);
-    TRY_ERROR(DwarfInfo::LineTable, debug_info, res, error);
+/// Appends table to lineTable. File indices of its lines are moved past the files already there.
+static void append_line_table(DwarfInfo::LineTable &lineTable, DwarfInfo::LineTable &&table) {
+  auto fileIndexOffset = static_cast<int32_t>(lineTable.files.size());
+  std::move(table.files.begin(), table.files.end(), std::back_inserter(lineTable.files));
 
-    if (res == DW_DLV_NO_ENTRY)
-      break; // no more entries, exit.
+  for (auto [cu_index, first] : table.unitFiles) {
+    lineTable.unitFiles[cu_index] = first + fileIndexOffset;
+  }
 
-    Dwarf_Die cu_die;
-    res = dwarf_siblingof_b(debug_info, nullptr, is_info, &cu_die, &error);
-    TRY_ERROR(DwarfInfo::LineTable, debug_info, res, error);
-    if (res == DW_DLV_NO_ENTRY)
-      continue;
+  for (auto &line : table.lines) {
+    if (line.fileIndex >= 0)
+      line.fileIndex += fileIndexOffset;
+    lineTable.lines.push_back(line);
+  }
 
-    Dwarf_Unsigned line_version = 0;
-    Dwarf_Small table_type = 0;
-    Dwarf_Line_Context line_context = nullptr;
+  table = {};
+}
 
-    res = dwarf_srclines_b(cu_die, &line_version,
-                           &table_type, &line_context, &error);
-    TRY_ERROR(DwarfInfo::LineTable, debug_info, res, error);
+static Result<std::vector<std::unique_ptr<ConcreteFunctionInfo>>, QString>
+scan_debug_info(std::vector<DwarfHandle> &handles, const std::vector<Dwarf_Off> &cuOffsets,
+                const DwarfInfo::LineTable &lineTable, std::vector<SymbolStringPool> &pools) {
+  std::vector<std::vector<std::unique_ptr<ConcreteFunctionInfo>>> cuFunctions(cuOffsets.size());
 
-    if (table_type != 1) {
-      std::cout << std::dec << "unexpected table_type = " << (int) table_type << ", line_version = " << line_version
-                << std::endl;
-      continue;
-    }
+  auto error = for_each_cu_parallel(handles, cuOffsets, [&](Dwarf_Debug debug_info, Dwarf_Die cu_die, int cu_index, size_t worker) {
+    auto result = scan_cu(debug_info, cu_die, cu_index, lineTable, pools[worker]);
+    if (result.is_error())
+      return std::optional<QString>(std::move(result).into_error());
 
-    char **srcFiles = nullptr;
-    Dwarf_Signed srcFilesCount = 0;
+    cuFunctions[cu_index] = std::move(result).into_value();
+    return std::optional<QString>();
+  });
+  if (error) {
+    return Result<std::vector<std::unique_ptr<ConcreteFunctionInfo>>, QString>::with_error(std::move(*error));
+  }
 
-    res = dwarf_srcfiles(cu_die, &srcFiles, &srcFilesCount, &error);
-    if (res != DW_DLV_OK) {
-      return Result<DwarfInfo::LineTable, QString>::with_error(handle_error(debug_info, error));
+  // concatenate in CU order so the result doesn't depend on scheduling.
+  std::vector<std::unique_ptr<ConcreteFunctionInfo>> functions;
+  {
+    size_t count = 0;
+    for (auto &list : cuFunctions) {
+      count += list.size();
     }
+    functions.reserve(count);
 
-    size_t fileIndexOffset = lineTable.files.size();
-
-    for (Dwarf_Signed j = 0; j < srcFilesCount; j++) {
-      char *name = srcFiles[j];
-      // std::cout << "file: " << name << std::endl;
-
-      lineTable.files.push_back(DwarfInfo::LineFileInfo{cu_index, j + 1, QString(name), 0});
-
-      dwarf_dealloc(debug_info, name, DW_DLA_STRING);
+    for (auto &list : cuFunctions) {
+      std::move(list.begin(), list.end(), std::back_inserter(functions));
     }
+  }
 
-    dwarf_dealloc(debug_info, srcFiles, DW_DLA_LIST);
-    srcFiles = nullptr;
 
-    Dwarf_Line *linebuf = 0;
-    Dwarf_Signed linecount = 0;
+  sort_and_link_functions(functions);
 
-    res = dwarf_srclines_from_linecontext(line_context, &linebuf, &linecount, &error);
-    if (res != DW_DLV_OK) {
-      dwarf_srclines_dealloc_b(line_context);
-      line_context = 0;
-      return Result<DwarfInfo::LineTable, QString>::with_error(handle_error(debug_info, error));
-    }
-
-    for (int i = 0; i < linecount; ++i) {
-      Dwarf_Addr lineaddr = 0;
-      Dwarf_Unsigned filenum = 0;
-      Dwarf_Unsigned lineno = 0;
+//  for (auto &func : functions) {
+//    func->dump();
+//  }
 
-      res = dwarf_lineno(linebuf[i], &lineno, &error);
-      TRY_ERROR(DwarfInfo::LineTable, debug_info, res, error);
+  return Result<std::vector<std::unique_ptr<ConcreteFunctionInfo>>, QString>::with_value(std::move(functions));
+}
 
-      res = dwarf_line_srcfileno(linebuf[i], &filenum, &error);
-      TRY_ERROR(DwarfInfo::LineTable, debug_info, res, error);
+static Result<DwarfInfo::LineTable, QString>
+generate_line_table(std::vector<DwarfHandle> &handles, const std::vector<Dwarf_Off> &cuOffsets,
+                    std::vector<SymbolStringPool> &pools) {
+  std::vector<DwarfInfo::LineTable> cuTables(cuOffsets.size());
 
-      assert(filenum != 0 && "filenum was zero");
-      if (filenum) {
-        filenum -= 1;
-      }
-      res = dwarf_lineaddr(linebuf[i], &lineaddr, &error);
-      TRY_ERROR(DwarfInfo::LineTable, debug_info, res, error);
+  auto error = for_each_cu_parallel(handles, cuOffsets, [&](Dwarf_Debug debug_info, Dwarf_Die cu_die, int cu_index, size_t worker) {
+    auto result = cu_line_table(debug_info, cu_die, cu_index, pools[worker]);
+    if (result.is_error())
+      return std::optional<QString>(std::move(result).into_error());
 
-      int32_t fileIndex = -1;
-      if (fileIndexOffset + filenum < lineTable.files.size()) {
-        fileIndex = (int32_t) (fileIndexOffset + filenum);
-      }
+    cuTables[cu_index] = std::move(result).into_value();
+    return std::optional<QString>();
+  });
+  if (error) {
+    return Result<DwarfInfo::LineTable, QString>::with_error(std::move(*error));
+  }
 
-      lineTable.lines.push_back(DwarfInfo::LineInfo{lineaddr, fileIndex, (uint32_t) lineno});
+  DwarfInfo::LineTable lineTable;
+  {
+    size_t fileCount = 0;
+    size_t lineCount = 0;
+    for (auto &table : cuTables) {
+      fileCount += table.files.size();
+      lineCount += table.lines.size();
     }
-
-    dwarf_srclines_dealloc_b(line_context);
+    lineTable.files.reserve(fileCount);
+    lineTable.lines.reserve(lineCount);
   }
 
-  std::stable_sort(lineTable.lines.begin(), lineTable.lines.end(), [](auto &a, auto &b) {
-    return a.address < b.address;
-  });
+  // merge in CU order, file indices become indices into the merged file list.
+  for (auto &table : cuTables) {
+    append_line_table(lineTable, std::move(table));
+  }
 
 //  for (auto &addr : lineTable.lines) {
 //    auto *file = addr.fileIndex >= 0 ? &lineTable.files[addr.fileIndex] : nullptr;
@@ -1031,6 +1601,7 @@ static Result<DwarfInfo::LineTable, QString> generate_line_table(Dwarf_Debug deb
 }
 
 
+
 Result<DwarfLoader, QString> DwarfLoader::openFile(const QString &file) {
   int fd = open(file.toUtf8().data(), O_RDONLY);
   if (fd < 0) {
@@ -1069,19 +1640,60 @@ Result<DwarfInfo, QString> DwarfLoader::load() {
 
   switch (dwarf_err) {
     case DW_DLV_OK: {
+      PhaseTimer total("total");
+      PhaseTimer phase("enumerate units");
+
+      auto cuOffsets = enumerate_cus(debug_info);
+      if (cuOffsets.is_error()) {
+        return Result<DwarfInfo, QString>::with_error(std::move(cuOffsets).into_error());
+      }
+
+      // CUs are independent, give each thread its own handle and split them up.
+      phase.next("open handles");
+      std::vector<DwarfHandle> handles{DwarfHandle{fd, elf, debug_info}};
+      {
+        size_t threadCount = std::max(1u, std::thread::hardware_concurrency());
+        threadCount = std::min(threadCount, cuOffsets.as_value().size());
+
+        while (handles.size() < threadCount) {
+          auto handle = open_handle(file);
+          if (!handle) {
+            std::cout << "failed to open another dwarf handle, loading with " << handles.size() << " threads" << std::endl;
+            break;
+          }
+          handles.push_back(*handle);
+        }
+      }
+
+      // one pool per thread, merged once everything is loaded.
+      std::vector<SymbolStringPool> pools(handles.size());
 
-      auto lineTable = generate_line_table(debug_info);
+      phase.next("line tables");
+      auto lineTable = generate_line_table(handles, cuOffsets.as_value(), pools);
       if (lineTable.is_error()) {
+        close_worker_handles(handles);
         return Result<DwarfInfo, QString>::with_error(std::move(lineTable).into_error());
       }
 
-      auto functions = scan_debug_info(debug_info, lineTable.as_value());
+      phase.next("functions");
+      auto functions = scan_debug_info(handles, cuOffsets.as_value(), lineTable.as_value(), pools);
       if (functions.is_error()) {
+        close_worker_handles(handles);
         return Result<DwarfInfo, QString>::with_error(std::move(functions).into_error());
       }
 
+      // every string the loader keeps is pooled, the extra handles are done.
+      close_worker_handles(handles);
+
+      phase.next("merge strings");
+      SymbolStringPool strings;
+      for (auto &pool : pools) {
+        strings.merge(std::move(pool));
+      }
+
+      phase.next("line and address maps");
       DwarfInfo info(std::move(file), std::move(buildId), std::move(functions).into_value(),
-                     std::move(lineTable).into_value());
+                     std::move(lineTable).into_value(), std::move(strings));
 
       info.internal->fd = fd;
       info.internal->elf = elf;
@@ -1110,6 +1722,175 @@ Result<DwarfInfo, QString> DwarfLoader::load() {
   }
 }
 
+Result<DwarfInfo, QString> DwarfLoader::loadIndex(const QString &path) {
+  auto contents = SymbolIndex::read(path, buildId);
+  if (!contents) {
+    return Result<DwarfInfo, QString>::with_error(QString("no symbol index"));
+  }
+
+  // names point into the mapped index, there is nothing to pool.
+  DwarfInfo info(std::move(file), std::move(buildId), std::move(contents->functions),
+                 std::move(contents->lineTable), SymbolStringPool());
+
+  info.internal->fd = fd;
+  info.internal->elf = elf;
+  info.internal->symbolIndex = std::move(contents->file);
+
+  return Result<DwarfInfo, QString>::with_value(std::move(info));
+}
+
+Result<DwarfInfo, QString> DwarfLoader::loadLazy() {
+  auto handle = open_handle(file);
+  if (!handle) {
+    return Result<DwarfInfo, QString>::with_error(QString("failed to open dwarf handle"));
+  }
+
+  auto units = std::make_shared<DwarfInfo::LazyUnits>();
+  units->fd = handle->fd;
+  units->elf = handle->elf;
+  units->debugInfo = handle->debug_info;
+
+  auto cuOffsets = enumerate_cus(units->debugInfo);
+  if (cuOffsets.is_error()) {
+    return Result<DwarfInfo, QString>::with_error(std::move(cuOffsets).into_error());
+  }
+  units->unitOffsets = std::move(cuOffsets).into_value();
+  units->requested.resize(units->unitOffsets.size());
+
+  // Only the unit DIEs themselves are read, their children are left for parse().
+  for (size_t i = 0; i < units->unitOffsets.size(); i++) {
+    Dwarf_Die cu_die;
+    Dwarf_Error error;
+    int res = dwarf_offdie_b(units->debugInfo, units->unitOffsets[i], true, &cu_die, &error);
+    TRY_ERROR(DwarfInfo, units->debugInfo, res, error);
+    if (res == DW_DLV_NO_ENTRY)
+      continue;
+
+    auto cu_info = read_cu_info(units->debugInfo, cu_die);
+    for (auto [low, high] : build_ranges(units->debugInfo, cu_info, cu_die)) {
+      units->ranges.push_back(DwarfInfo::LazyUnits::UnitRange{low, high, static_cast<uint32_t>(i)});
+    }
+
+    dwarf_dealloc_die(cu_die);
+  }
+
+  std::sort(units->ranges.begin(), units->ranges.end(), [](auto &a, auto &b) {
+    return a.low < b.low;
+  });
+
+  std::cout << "found " << units->unitOffsets.size() << " compilation units, " << units->ranges.size() << " ranges" << std::endl;
+
+  DwarfInfo info(std::move(file), std::move(buildId), {}, {}, SymbolStringPool());
+
+  info.internal->fd = fd;
+  info.internal->elf = elf;
+  info.internal->lazyUnits = std::move(units);
+
+  return Result<DwarfInfo, QString>::with_value(std::move(info));
+}
+
+DwarfInfo::LazyUnits::~LazyUnits() {
+  Dwarf_Error error;
+  dwarf_finish(debugInfo, &error);
+  elf_end(elf);
+  close(fd);
+}
+
+std::vector<uint32_t> DwarfInfo::LazyUnits::request(const std::vector<uint64_t> &addresses) {
+  std::lock_guard<std::mutex> _guard(lock);
+
+  std::vector<uint32_t> units;
+  for (auto address : addresses) {
+    // last range starting at or before address.
+    auto it = std::upper_bound(ranges.begin(), ranges.end(), address, [](uint64_t address, auto &range) {
+      return address < range.low;
+    });
+    if (it == ranges.begin())
+      continue;
+    --it;
+
+    if (address < it->high && !requested[it->unit]) {
+      requested[it->unit] = true;
+      units.push_back(it->unit);
+    }
+  }
+
+  return units;
+}
+
+std::vector<uint32_t> DwarfInfo::LazyUnits::requestDies(const std::vector<Dwarf_Off> &offsets) {
+  std::lock_guard<std::mutex> _guard(lock);
+
+  std::vector<uint32_t> units;
+  for (auto offset : offsets) {
+    // units are in .debug_info order, the DIE belongs to the last one starting at or before it.
+    auto it = std::upper_bound(unitOffsets.begin(), unitOffsets.end(), offset);
+    if (it == unitOffsets.begin())
+      continue;
+
+    auto unit = static_cast<uint32_t>(it - unitOffsets.begin() - 1);
+    if (!requested[unit]) {
+      requested[unit] = true;
+      units.push_back(unit);
+    }
+  }
+
+  return units;
+}
+
+Result<DwarfInfo::ParsedUnits, QString> DwarfInfo::LazyUnits::parse(const std::vector<uint32_t> &units) {
+  ParsedUnits parsed;
+
+  for (auto unit : units) {
+    Dwarf_Die cu_die;
+    Dwarf_Error error;
+    int res = dwarf_offdie_b(debugInfo, unitOffsets.at(unit), true, &cu_die, &error);
+    TRY_ERROR(ParsedUnits, debugInfo, res, error);
+    if (res == DW_DLV_NO_ENTRY)
+      continue;
+
+    auto lineTable = cu_line_table(debugInfo, cu_die, static_cast<int>(unit), parsed.strings);
+    if (lineTable.is_error()) {
+      dwarf_dealloc_die(cu_die);
+      return Result<ParsedUnits, QString>::with_error(std::move(lineTable).into_error());
+    }
+
+    auto functions = scan_cu(debugInfo, cu_die, static_cast<int>(unit), lineTable.as_value(), parsed.strings);
+    dwarf_dealloc_die(cu_die);
+    if (functions.is_error()) {
+      return Result<ParsedUnits, QString>::with_error(std::move(functions).into_error());
+    }
+
+    append_line_table(parsed.lineTable, std::move(lineTable).into_value());
+    std::move(functions.as_value().begin(), functions.as_value().end(), std::back_inserter(parsed.functions));
+  }
+
+  return Result<ParsedUnits, QString>::with_value(std::move(parsed));
+}
+
+std::shared_ptr<DwarfInfo::LazyUnits> DwarfInfo::lazyUnits() const {
+  return internal->lazyUnits;
+}
+
+void DwarfInfo::addUnits(ParsedUnits &&units) {
+  strings.merge(std::move(units.strings));
+
+  for (auto &function : units.functions) {
+    function->buildId = getBuildId();
+  }
+  assign_linkage_ids(units.functions);
+
+  std::move(units.functions.begin(), units.functions.end(), std::back_inserter(functions));
+  sort_and_link_functions(functions);
+
+  LineTable lineTable{std::move(lineFiles), decodeLines()};
+  append_line_table(lineTable, std::move(units.lineTable));
+  lineFiles = std::move(lineTable.files);
+  buildLineMap(std::move(lineTable.lines));
+
+  buildAddressMap();
+}
+
 uint64_t DwarfInfo::getBuildId() const {
   uint64_t num = 0;
   for (size_t i = 0; i < 8 && i < buildId.size(); i++) {
@@ -8,18 +8,23 @@
 #include <ctime>
 #include <iostream>
 #include <memory>
+#include <mutex>
 #include <optional>
 #include <string>
+#include <string_view>
+#include <unordered_map>
 #include <vector>
 
 #include <QString>
 
 #include "libdwarf.h"
 #include "Result.h"
+#include "SymbolStringPool.h"
 
 struct ConcreteFunctionInfo;
 struct InlinedFunctionInfo;
 struct DwarfLoader;
+struct SymbolIndex;
 
 struct AbstractFunctionInfo {
   [[nodiscard]] virtual bool isInline() const = 0;
@@ -42,7 +47,8 @@ struct InlinedFunctionInfo : public AbstractFunctionInfo {
 
   std::vector<std::pair<uint64_t, uint64_t>> ranges;
 
-  std::optional<std::pair<QString, uint32_t>> sourceLine;
+  // file is pooled in the owning DwarfInfo.
+  std::optional<std::pair<std::string_view, uint32_t>> sourceLine;
 
   void dump();
 
@@ -52,6 +58,7 @@ struct InlinedFunctionInfo : public AbstractFunctionInfo {
 
   [[nodiscard]] QString getFullName() const override;
 
+  /// Null while the unit of the origin is not parsed, see DwarfInfo::LazyUnits.
   ConcreteFunctionInfo *getConcreteFunction() override {
     return origin_fn;
   }
@@ -61,9 +68,13 @@ struct InlinedFunctionInfo : public AbstractFunctionInfo {
 
 struct ConcreteFunctionInfo : public AbstractFunctionInfo {
   Dwarf_Off die_offset = 0;
-  const char *name = nullptr;
-  QString full_name;
-  QString linkageName;
+  // all pooled in the owning DwarfInfo.
+  std::string_view name;
+  std::string_view full_name;
+  std::string_view linkageName;
+  // shared by every function with this linkageName in any loaded file, lets hot paths
+  // compare functions without touching the string. Assigned when added to a DwarfInfo.
+  uint32_t linkageId = 0;
   uint64_t buildId = 0;
 
   std::vector<std::unique_ptr<InlinedFunctionInfo>> inline_functions;
@@ -77,7 +88,7 @@ struct ConcreteFunctionInfo : public AbstractFunctionInfo {
   }
 
   [[nodiscard]] QString getFullName() const override {
-    return full_name;
+    return toQString(full_name);
   }
 
   ConcreteFunctionInfo *getConcreteFunction() override {
@@ -87,15 +98,25 @@ struct ConcreteFunctionInfo : public AbstractFunctionInfo {
   [[nodiscard]] bool containsAddress(uint64_t address) const override;
 };
 
+/// A pc resolved to its concrete function and the chain of functions inlined at it,
+/// outermost first. `inlines` points into storage owned by whoever resolved it.
+struct ResolvedAddress {
+  ConcreteFunctionInfo *function = nullptr;
+  InlinedFunctionInfo *const *inlines = nullptr;
+  uint32_t inlineCount = 0;
+};
+
 class DwarfInfo {
   struct Internal;
   friend DwarfLoader;
+  friend SymbolIndex;
 
 public:
   struct LineFileInfo {
     int cu_index;
     Dwarf_Signed file_index;
-    QString name;
+    // pooled, paths repeat across compilation units.
+    std::string_view name;
     Dwarf_Unsigned length { 0 };
   };
 
@@ -108,20 +129,67 @@ public:
   struct LineTable {
     std::vector<LineFileInfo> files;
     std::vector<LineInfo> lines;
+    // where the files of each compilation unit start in files, they follow in file_index order.
+    // Only kept while loading, to look up DW_AT_call_file.
+    std::unordered_map<int, uint32_t> unitFiles;
+  };
+
+  class LazyUnits;
+
+  /// Functions and lines of some compilation units, see LazyUnits::parse().
+  struct ParsedUnits {
+    std::vector<std::unique_ptr<ConcreteFunctionInfo>> functions;
+    LineTable lineTable;
+    SymbolStringPool strings;
   };
 
 private:
+  class LineCursor;
+
+  /// Every function and inline range flattened into sorted, disjoint intervals that
+  /// each resolve to one function and inline chain. Stored column-wise so the search
+  /// only touches `starts`.
+  struct AddressMap {
+    std::vector<uint64_t> starts;
+    // exclusive
+    std::vector<uint64_t> ends;
+    std::vector<ConcreteFunctionInfo *> functions;
+    // interval i's chain is inlines[inlineOffsets[i]...] with inlineCounts[i] entries.
+    std::vector<uint32_t> inlineOffsets;
+    std::vector<uint32_t> inlineCounts;
+    // chains are deduplicated, outermost function first.
+    std::vector<InlinedFunctionInfo *> inlines;
+  };
+
+  /// The line table, sorted and with one row per address, packed into blocks of kBlockSize
+  /// rows. A block stores its first row as is and every other row as varint deltas to the
+  /// previous one, so only `blockStarts` is searched and then at most one block is decoded.
+  struct LineMap {
+    static constexpr size_t kBlockSize = 64;
+
+    // address of the first row in each block.
+    std::vector<uint64_t> blockStarts;
+    // where each block starts in bytes.
+    std::vector<uint32_t> blockOffsets;
+    std::vector<uint8_t> bytes;
+    size_t count = 0;
+  };
+
   std::vector<uint8_t> buildId;
+  // names and paths of functions and lineTable.
+  SymbolStringPool strings;
   std::vector<std::unique_ptr<ConcreteFunctionInfo>> functions;
   std::unique_ptr<Internal> internal;
 
-  LineTable lineTable;
+  std::vector<LineFileInfo> lineFiles;
+  LineMap lineMap;
+  AddressMap addressMap;
 
 public:
   QString file;
   std::time_t loaded_time;
 
-  explicit DwarfInfo(QString &&file, std::vector<uint8_t> &&buildId, std::vector<std::unique_ptr<ConcreteFunctionInfo>> &&functions, LineTable &&lineTable);
+  explicit DwarfInfo(QString &&file, std::vector<uint8_t> &&buildId, std::vector<std::unique_ptr<ConcreteFunctionInfo>> &&functions, LineTable &&lineTable, SymbolStringPool &&strings);
 
   explicit DwarfInfo(const DwarfInfo &other) = delete;
 
@@ -131,18 +199,95 @@ public:
 
   void readFromAddress(uint8_t *buffer, uint64_t address, size_t length);
 
+  /// Like resolve_address() but without allocating, `inlines` points into this DwarfInfo.
+  ResolvedAddress resolve(uint64_t address) const;
+
   std::optional<std::pair<ConcreteFunctionInfo *, std::vector<InlinedFunctionInfo *>>> resolve_address(uint64_t address) const;
 
+  /// resolve() for many addresses at once, results are in the order of addresses.
+  /// Addresses are visited in sorted order in a single forward sweep over the address map.
+  /// With threads > 1 the sorted addresses are split into that many sweeps run in parallel.
+  std::vector<ResolvedAddress> resolveBatch(const std::vector<uint64_t> &addresses, unsigned threads = 1) const;
+
   std::optional<std::pair<QString, uint32_t>> getLineForAddress(uint64_t address) const;
 
+  /// getLineForAddress() for many addresses at once with the same sweep as resolveBatch().
+  std::vector<std::optional<std::pair<QString, uint32_t>>>
+  getLinesForAddresses(const std::vector<uint64_t> &addresses, unsigned threads = 1) const;
+
   std::pair<QString, bool> symbolicate(uint64_t address) const;
 
   uint64_t getBuildId() const;
 
+  /// Set if this was loaded with DwarfLoader::loadLazy(). Functions and lines then only
+  /// cover the compilation units parsed through it and merged in with addUnits().
+  [[nodiscard]] std::shared_ptr<LazyUnits> lazyUnits() const;
+
+  /// Merges in units parsed by lazyUnits() and rebuilds the address map, which invalidates
+  /// the inline chains of every ResolvedAddress handed out before.
+  void addUnits(ParsedUnits &&units);
+
 private:
+  /// Walks the function list and inline trees, only used to build the address map.
+  std::optional<std::pair<ConcreteFunctionInfo *, std::vector<InlinedFunctionInfo *>>> resolveSlow(uint64_t address) const;
+
+  void buildAddressMap();
+
+  /// Sorts lines by address, keeps the first row of each address and packs them into lineMap.
+  void buildLineMap(std::vector<LineInfo> &&lines);
+
+  /// Unpacks lineMap again, for rewriting it.
+  [[nodiscard]] std::vector<LineInfo> decodeLines() const;
+
+  [[nodiscard]] std::optional<std::pair<QString, uint32_t>> lineResult(const LineInfo &line) const;
+
+  [[nodiscard]] ResolvedAddress intervalAt(size_t index) const {
+    auto &map = addressMap;
+    return ResolvedAddress{map.functions[index], map.inlines.data() + map.inlineOffsets[index], map.inlineCounts[index]};
+  }
 
 };
 
+/// The compilation units of a lazily loaded DwarfInfo. Only the address ranges of each unit
+/// are read up front, units are parsed once a sampled address lands in them.
+///
+/// Has its own libdwarf handle so units can be parsed on another thread while the
+/// DwarfInfo is in use. Shared with that thread, so it may outlive the DwarfInfo.
+class DwarfInfo::LazyUnits {
+  struct UnitRange {
+    uint64_t low;
+    uint64_t high;
+    uint32_t unit;
+  };
+
+  std::mutex lock;
+  int fd = -1;
+  Elf *elf = nullptr;
+  Dwarf_Debug debugInfo = nullptr;
+  std::vector<Dwarf_Off> unitOffsets;
+  // sorted by low.
+  std::vector<UnitRange> ranges;
+  std::vector<bool> requested;
+
+  friend DwarfLoader;
+
+public:
+  LazyUnits() = default;
+
+  LazyUnits(const LazyUnits &other) = delete;
+
+  ~LazyUnits();
+
+  /// Units that cover any of addresses and were not requested before, they are marked requested.
+  std::vector<uint32_t> request(const std::vector<uint64_t> &addresses);
+
+  /// Units holding any of the DIEs at offsets that were not requested before, they are marked requested.
+  std::vector<uint32_t> requestDies(const std::vector<Dwarf_Off> &offsets);
+
+  /// Parses the given units. Not safe to call from several threads at once.
+  Result<ParsedUnits, QString> parse(const std::vector<uint32_t> &units);
+};
+
 struct DwarfLoader {
   int fd;
   Elf *elf;
@@ -160,6 +305,13 @@ struct DwarfLoader {
 
   Result<DwarfInfo, QString> load();
 
+  /// Like load() but reads the functions and line table from a SymbolIndex written earlier.
+  /// Fails without touching the loader if there is no usable index at path.
+  Result<DwarfInfo, QString> loadIndex(const QString &path);
+
+  /// Like load() but only reads where each compilation unit is, see DwarfInfo::LazyUnits.
+  Result<DwarfInfo, QString> loadLazy();
+
 };
 
 
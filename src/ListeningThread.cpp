@@ -2,16 +2,24 @@
 // Created by Will Gulian on 11/25/20.
 //
 
+#include <chrono>
+#include <cstring>
+#include <thread>
+
 #include <sys/socket.h>
+#include <sys/time.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
+#include <unistd.h>
 
 #include "capnp/message.h"
 
 #include "ListeningThread.h"
 
 #define PORT 4000
-#define BUFSIZE 2048
+#define BATCH_SIZE 64
+#define SOCKET_BUFFER_SIZE (8 * 1024 * 1024)
+#define STATS_INTERVAL_SECONDS 10
 
 void ListeningThread::run() {
   printf("Starting listening thread...\n");
@@ -29,6 +37,28 @@ void ListeningThread::run() {
     exit(1);
   }
 
+  // Give the kernel room to absorb bursts while the decoder catches up.
+  // The OS may clamp this, which is fine.
+  int bufferSize = SOCKET_BUFFER_SIZE;
+  if (setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &bufferSize, sizeof(bufferSize)) < 0) {
+    perror("setting receive buffer size failed");
+  }
+
+#ifdef SO_RXQ_OVFL
+  // Have the kernel report how many datagrams it dropped because the buffer was full.
+  int overflowCount = 1;
+  if (setsockopt(fd, SOL_SOCKET, SO_RXQ_OVFL, &overflowCount, sizeof(overflowCount)) < 0) {
+    perror("enabling drop counter failed");
+  }
+#endif
+
+  // Wake up periodically so should_close is noticed.
+  struct timeval timeout{};
+  timeout.tv_usec = 200 * 1000;
+  if (setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout)) < 0) {
+    perror("setting receive timeout failed");
+  }
+
   in_addr_t source_address = inet_addr("239.15.55.200");
 
   struct sockaddr_in myaddr;
@@ -53,22 +83,137 @@ void ListeningThread::run() {
     exit(1);
   }
 
-  struct sockaddr_in remaddr;     /* remote address */
-  socklen_t addrlen = sizeof(remaddr);
-  int recvlen;
-  uint8_t buf[BUFSIZE];     /* receive buffer */
+  printf("waiting on port %d\n", PORT);
+
+  std::atomic<bool> receiving{true};
+  std::thread decoder([&] { decodeLoop(receiving); });
 
   while (!should_close) {
-    printf("waiting on port %d\n", PORT);
-    recvlen = recvfrom(fd, buf, BUFSIZE, 0, (struct sockaddr *)&remaddr, &addrlen);
-    printf("received %d bytes\n", recvlen);
+    receiveBatch(fd);
+  }
 
-    trace_data->parse(buf, recvlen);
+  receiving = false;
+  decoder.join();
+
+  close(fd);
+}
+
+void ListeningThread::receiveBatch(int fd) {
+  size_t available = std::min<size_t>(ring.writeAvailable(), BATCH_SIZE);
+
+  if (available == 0) {
+    // The decoder is behind. Leave the datagrams in the socket buffer, which is sized to
+    // absorb bursts, and only lose them once it overflows.
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    return;
+  }
+
+  size_t count = 0;
+
+#ifdef __linux__
+  struct mmsghdr msgs[BATCH_SIZE];
+  struct iovec iovecs[BATCH_SIZE];
+  // room for the SO_RXQ_OVFL counter of each datagram.
+  alignas(struct cmsghdr) uint8_t control[BATCH_SIZE][CMSG_SPACE(sizeof(uint32_t))];
+  memset(msgs, 0, sizeof(msgs));
+
+  for (size_t i = 0; i < available; i++) {
+    auto &slot = ring.writeSlot(i);
+    iovecs[i].iov_base = slot.data;
+    iovecs[i].iov_len = sizeof(slot.data);
+    msgs[i].msg_hdr.msg_iov = &iovecs[i];
+    msgs[i].msg_hdr.msg_iovlen = 1;
+    msgs[i].msg_hdr.msg_control = control[i];
+    msgs[i].msg_hdr.msg_controllen = sizeof(control[i]);
+  }
 
-    if (recvlen > 0) {
-      buf[recvlen] = 0;
-      printf("received message: \"%s\"\n", buf);
+  // Block for the first datagram, then take whatever else is already queued.
+  int received = recvmmsg(fd, msgs, available, MSG_WAITFORONE, nullptr);
+  if (received <= 0)
+    return;
+
+  for (count = 0; count < static_cast<size_t>(received); count++) {
+    auto &slot = ring.writeSlot(count);
+    slot.length = msgs[count].msg_len;
+    slot.truncated = (msgs[count].msg_hdr.msg_flags & MSG_TRUNC) != 0;
+
+    for (auto cmsg = CMSG_FIRSTHDR(&msgs[count].msg_hdr); cmsg; cmsg = CMSG_NXTHDR(&msgs[count].msg_hdr, cmsg)) {
+      if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SO_RXQ_OVFL) {
+        // a running total of what the socket dropped so far.
+        uint32_t overflowed;
+        memcpy(&overflowed, CMSG_DATA(cmsg), sizeof(overflowed));
+        stats.dropped = overflowed;
+      }
     }
   }
+#else
+  // No recvmmsg(), emulate it with one blocking receive followed by non-blocking ones.
+  for (; count < available; count++) {
+    auto &slot = ring.writeSlot(count);
+
+    struct iovec iov{};
+    iov.iov_base = slot.data;
+    iov.iov_len = sizeof(slot.data);
+
+    struct msghdr msg{};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+
+    auto len = recvmsg(fd, &msg, count == 0 ? 0 : MSG_DONTWAIT);
+    if (len < 0)
+      break;
+
+    slot.length = static_cast<uint32_t>(len);
+    slot.truncated = (msg.msg_flags & MSG_TRUNC) != 0;
+  }
+
+  if (count == 0)
+    return;
+#endif
+
+  stats.received += count;
+  ring.commitWrite(count);
+}
+
+void ListeningThread::decodeLoop(const std::atomic<bool> &receiving) {
+  auto lastReport = std::chrono::steady_clock::now();
+  uint64_t lastReceived = 0;
+  TraceBatch batch;
+
+  while (true) {
+    auto count = ring.readAvailable();
+
+    if (count == 0) {
+      // only exit once everything received has been decoded.
+      if (!receiving)
+        break;
+
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    } else {
+      // Decode everything that is ready and merge it into the trace data in one go.
+      for (size_t i = 0; i < count; i++) {
+        auto &slot = ring.readSlot(i);
+        if (slot.truncated || !TraceData::decode(slot.data, slot.length, batch)) {
+          stats.malformed++;
+        }
+      }
+
+      ring.commitRead(count);
+
+      trace_data->insertBatch(batch);
+      batch.clear();
+    }
+
+    auto now = std::chrono::steady_clock::now();
+    if (now - lastReport >= std::chrono::seconds(STATS_INTERVAL_SECONDS)) {
+      lastReport = now;
 
+      uint64_t received = stats.received;
+      if (received != lastReceived) {
+        lastReceived = received;
+        printf("listener: received %llu, dropped %llu, malformed %llu\n", (unsigned long long) received,
+               (unsigned long long) stats.dropped.load(), (unsigned long long) stats.malformed.load());
+      }
+    }
+  }
 }
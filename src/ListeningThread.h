@@ -9,21 +9,51 @@
 
 #include <QThread>
 
+#include "SpscRing.h"
 #include "TraceData.h"
 
 class ListeningThread : public QThread {
 
   Q_OBJECT
 
+public:
+  static constexpr size_t kMaxDatagramSize = 2048;
+  static constexpr size_t kRingSize = 8192;
+
+  struct Datagram {
+    uint32_t length;
+    bool truncated;
+    uint8_t data[kMaxDatagramSize];
+  };
+
+  struct Stats {
+    std::atomic<uint64_t> received{0};
+    // the kernel's receive buffer overflowed, as reported by SO_RXQ_OVFL where supported.
+    std::atomic<uint64_t> dropped{0};
+    // truncated or failed to parse.
+    std::atomic<uint64_t> malformed{0};
+  };
+
 private:
   std::shared_ptr<TraceData> trace_data;
+  SpscRing<Datagram, kRingSize> ring;
+
 public:
   explicit ListeningThread(std::shared_ptr<TraceData> trace_data) : QThread(), trace_data(std::move(trace_data)) {}
 
   std::atomic<bool> should_close{false};
+  Stats stats;
 
   void run() override;
 
+private:
+  /// Receives as many datagrams as are ready into the ring, blocking for at most the socket timeout.
+  /// While the ring is full datagrams are left queued in the socket until the decoder frees slots.
+  void receiveBatch(int fd);
+
+  /// Consumer side of the ring, runs on its own thread until the receive loop exits.
+  void decodeLoop(const std::atomic<bool> &receiving);
+
 };
 
 
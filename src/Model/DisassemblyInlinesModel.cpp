@@ -38,6 +38,14 @@ void DisassemblyInlinesModel::disassembleRegion(const ConcreteFunctionInfo &func
 
   auto segment = dis.disassemble(data.data(), data.size(), startAddress);
 
+  std::vector<uint64_t> addresses;
+  addresses.reserve(segment.instructions.size());
+  for (auto &row : segment.instructions) {
+    addresses.push_back(row.address);
+  }
+  auto sourceLines = debugFile->second.getLinesForAddresses(addresses);
+  size_t rowIndex = 0;
+
   std::vector<CodeSection *> sectionStack;
   sectionStack.push_back(&root);
 
@@ -86,7 +94,7 @@ void DisassemblyInlinesModel::disassembleRegion(const ConcreteFunctionInfo &func
       jumpOffset = (int)(row.jumpTarget.value() - row.address);
     }
 
-    auto sourceLine = debugFile->second.getLineForAddress(row.address);
+    auto sourceLine = std::move(sourceLines[rowIndex++]);
 
     auto info = std::make_unique<RowInfo>(std::move(row), samples, jumpOffset, row.jumpTarget, std::move(sourceLine));
 
@@ -173,7 +181,7 @@ QVariant DisassemblyInlinesModel::data(const QModelIndex &index, int role) const
           if (auto it = debugTable->loadedFiles.find(buildId); it != debugTable->loadedFiles.end()) {
             if (auto funcs = it->second.resolve_address(inst->jumpLocation.value()); funcs) {
               name += "    < ";
-              name += funcs->first->full_name;
+              name += toQString(funcs->first->full_name);
               name += " >";
             }
           }
@@ -226,13 +234,14 @@ QVariant DisassemblyInlinesModel::data(const QModelIndex &index, int role) const
         if (!func->inlineInfo->sourceLine)
           return QVariant();
 
+        auto path = toQString(func->inlineInfo->sourceLine->first);
         if (role == Qt::DisplayRole) {
-          auto file = func->inlineInfo->sourceLine->first.section('/', -1);
+          auto file = path.section('/', -1);
           file += ":";
           file += QString::number(func->inlineInfo->sourceLine->second);
           return file;
         } else if (role == Qt::ToolTipRole) {
-          return func->inlineInfo->sourceLine->first + ":" + QString::number(func->inlineInfo->sourceLine->second);
+          return path + ":" + QString::number(func->inlineInfo->sourceLine->second);
         } else {
           return QVariant();
         }
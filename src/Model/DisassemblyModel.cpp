@@ -42,6 +42,14 @@ void DisassemblyModel::disassembleRegion(uint64_t buildId, uint64_t startAddress
 
   auto segment = dis.disassemble(data.data(), data.size(), startAddress);
 
+  std::vector<uint64_t> addresses;
+  addresses.reserve(segment.instructions.size());
+  for (auto &row : segment.instructions) {
+    addresses.push_back(row.address);
+  }
+  auto sourceLines = debugFile->second.getLinesForAddresses(addresses);
+
+  size_t rowIndex = 0;
   for (auto &&row : std::move(segment.instructions)) {
     int samples = 0;
     if (addrCounts) {
@@ -55,7 +63,7 @@ void DisassemblyModel::disassembleRegion(uint64_t buildId, uint64_t startAddress
       jumpOffset = (int)(row.jumpTarget.value() - row.address);
     }
 
-    auto sourceLine = debugFile->second.getLineForAddress(row.address);
+    auto sourceLine = std::move(sourceLines[rowIndex++]);
 
     rows.push_back(RowInfo { std::move(row), samples, jumpOffset, std::move(sourceLine) });
   }
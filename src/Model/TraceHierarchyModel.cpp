@@ -2,7 +2,9 @@
 // Created by Will Gulian on 12/19/20.
 //
 
-#include <unordered_set>
+#include <algorithm>
+#include <thread>
+#include <unordered_map>
 
 #include <QPalette>
 #include <QSize>
@@ -16,15 +18,29 @@ enum class ItemType {
   Function,
 };
 
+/// A node of the call tree. Nodes live in HierarchyTree::items and refer to each other by
+/// index, so they are trivially destructible and a tree is freed with a handful of buffers.
 struct TraceHierarchyModel::HierarchyItem {
-  std::vector<std::unique_ptr<HierarchyItem>> children;
-  HierarchyItem *parent{nullptr};
-  int selfIndex{-1};
+  static constexpr uint32_t kNone = std::numeric_limits<uint32_t>::max();
+
+  uint32_t parent{kNone};
+  uint32_t selfIndex{0};
+  // children are HierarchyTree::childSlots[firstSlot...] with childCount entries.
+  uint32_t firstSlot{0};
+  uint32_t slotCapacity{0};
+  uint32_t childCount{0};
+  // rows views know about. Incremental updates add children first and announce them in one go later.
+  uint32_t visibleChildren{0};
   size_t count{0};
   size_t selfCount{0};
   ItemType itemType{ItemType::Invalid};
+  // equal within an item type exactly for items that targetMatch, see computeMatchKey().
+  uint64_t matchKey{0};
 
-  std::unordered_map<uint64_t, size_t> addrCount;
+  // set while this item is in a ChangeSet: added, gained children, or changed counts.
+  bool pendingInsert{false};
+  bool pendingGrow{false};
+  bool pendingChange{false};
 
   // RawAddress fields
   uint64_t address{0};
@@ -36,37 +52,36 @@ struct TraceHierarchyModel::HierarchyItem {
   HierarchyItem() = default;
 
   explicit HierarchyItem(uint64_t address)
-          : itemType(ItemType::RawAddress), address(address) {}
+          : itemType(ItemType::RawAddress), address(address) {
+    matchKey = computeMatchKey();
+  }
 
   explicit HierarchyItem(AbstractFunctionInfo *functionInfo)
-          : itemType(ItemType::Function), functionInfo(functionInfo) {}
-
-  explicit HierarchyItem(HierarchyItem &&other) = default;
-
-  virtual ~HierarchyItem() = default;
-
-  HierarchyItem &operator=(HierarchyItem &&) = default;
+          : itemType(ItemType::Function), functionInfo(functionInfo) {
+    matchKey = computeMatchKey();
+  }
 
   [[nodiscard]] ConcreteFunctionInfo *getConcreteFunction() const {
     return functionInfo ? functionInfo->getConcreteFunction() : nullptr;
   }
 
-  [[nodiscard]] bool targetMatch(const HierarchyItem *other) const {
-    if (itemType != other->itemType)
-      return false;
-    if (itemType == ItemType::Invalid)
-      return true;
-    if (itemType == ItemType::RawAddress)
-      return address == other->address;
-
-    auto &link = getConcreteFunction()->linkageName;
-    auto &otherLink = other->getConcreteFunction()->linkageName;
-    return link == otherLink;
+  /// Functions match by linkage name, through its id. Addresses match by value.
+  [[nodiscard]] bool targetMatch(const HierarchyItem &other) const {
+    return itemType == other.itemType && matchKey == other.matchKey;
   }
 
-  [[nodiscard]] std::pair<ItemType, uint64_t> matchId() const {
-    return std::make_pair(itemType,
-                          itemType == ItemType::Function ? reinterpret_cast<uint64_t>(functionInfo) : address);
+  /// The linkage id of functions and the address of anything else, exact within an item type.
+  [[nodiscard]] uint64_t computeMatchKey() const {
+    if (itemType == ItemType::Function) {
+      if (auto *concrete = getConcreteFunction())
+        return (uint64_t(1) << 63) | concrete->linkageId;
+
+      // An inline whose origin's unit is not parsed yet, keyed by where the origin is until
+      // the unit comes in and the tree is rebuilt. Only then can inlines of different files
+      // share a key.
+      return (uint64_t(3) << 62) | static_cast<InlinedFunctionInfo *>(functionInfo)->origin_offset;
+    }
+    return address;
   }
 
   [[nodiscard]] QString getName() const {
@@ -81,11 +96,239 @@ struct TraceHierarchyModel::HierarchyItem {
   }
 };
 
+namespace {
+
+struct ChildKey {
+  uint32_t parent;
+  uint64_t matchKey;
+
+  bool operator==(const ChildKey &other) const {
+    return parent == other.parent && matchKey == other.matchKey;
+  }
+};
+
+struct ChildKeyHash {
+  size_t operator()(const ChildKey &key) const {
+    return std::hash<uint64_t>()(key.matchKey * 0x9e3779b97f4a7c15ULL + key.parent);
+  }
+};
+
+struct UniqueStack {
+  uint64_t buildId;
+  uint32_t stackId;
+  size_t count;
+};
+
+struct UniqueStackKeyHash {
+  size_t operator()(const std::pair<uint64_t, uint32_t> &key) const {
+    return std::hash<uint64_t>()(key.first * 0x9e3779b97f4a7c15ULL + key.second);
+  }
+};
+
+/// Distinct stacks in order of first occurrence, with how often each was seen.
+struct StackCounter {
+  std::vector<UniqueStack> stacks;
+  std::unordered_map<std::pair<uint64_t, uint32_t>, size_t, UniqueStackKeyHash> lookup;
+
+  void add(uint64_t buildId, uint32_t stackId, size_t count) {
+    auto [it, inserted] = lookup.try_emplace(std::make_pair(buildId, stackId), stacks.size());
+    if (inserted) {
+      stacks.push_back(UniqueStack{buildId, stackId, 0});
+    }
+    stacks[it->second].count += count;
+  }
+};
+
+// Full builds only spread out over threads once every thread gets at least this much to do.
+constexpr size_t kChunksPerThread = 64;
+constexpr size_t kStacksPerThread = 4096;
+
+}
+
+/// What a tree is built from: a snapshot of the events and the settings at the time.
+struct TraceHierarchyModel::RebuildRequest {
+  TraceEventStore events;
+  uint64_t changeCount { 0 };
+  ViewPerspective viewPerspective { ViewPerspective::BottomUp };
+  bool showInlineFuncs { true };
+  uint64_t rangeStart { 0 };
+  uint64_t rangeEnd { std::numeric_limits<uint64_t>::max() };
+  uint64_t generation { 0 };
+};
+
+/// The call tree, item 0 is the invisible root.
+struct TraceHierarchyModel::HierarchyTree {
+  /// Items with more children than this look them up in childIndex instead of scanning.
+  static constexpr uint32_t kChildIndexThreshold = 16;
+
+  std::vector<HierarchyItem> items;
+  // Every item's children are a run of slots here. A run that fills up is moved to the end
+  // with twice the room, the old slots stay unused until the tree is rebuilt.
+  std::vector<uint32_t> childSlots;
+  // (parent, matchKey) -> child, only for wide items. Addresses with the top bit set can share a key
+  // with a function, hits are checked with targetMatch.
+  std::unordered_map<ChildKey, uint32_t, ChildKeyHash> childIndex;
+
+  // What the tree counts, to count addresses on demand: these stacks walked with these settings.
+  // Only the stack table is kept and not the events, it shares blocks without holding up inserts.
+  StackTable stackTable;
+  StackCounter counted;
+  ViewPerspective viewPerspective { ViewPerspective::BottomUp };
+  bool showInlineFuncs { true };
+  // item -> samples per pc, filled in by requestAddrCounts() and dropped whenever counts change.
+  std::unordered_map<uint32_t, std::unordered_map<uint64_t, size_t>> addressCounts;
+
+  HierarchyTree() {
+    items.emplace_back(std::numeric_limits<uint64_t>::max());
+  }
+
+  [[nodiscard]] uint32_t childAt(uint32_t parent, uint32_t row) const {
+    return childSlots[items[parent].firstSlot + row];
+  }
+
+  [[nodiscard]] uint32_t findChild(uint32_t parent, const HierarchyItem &item) const {
+    auto &parentItem = items[parent];
+    if (parentItem.childCount > kChildIndexThreshold) {
+      auto it = childIndex.find(ChildKey{parent, item.matchKey});
+      if (it == childIndex.end())
+        return HierarchyItem::kNone;
+      if (items[it->second].targetMatch(item))
+        return it->second;
+      // another child has the same key, fall through to the slow path.
+    }
+
+    for (uint32_t row = 0; row < parentItem.childCount; row++) {
+      auto child = childAt(parent, row);
+      if (items[child].targetMatch(item))
+        return child;
+    }
+    return HierarchyItem::kNone;
+  }
+
+  uint32_t addChild(uint32_t parent, HierarchyItem item) {
+    auto index = static_cast<uint32_t>(items.size());
+    item.parent = parent;
+    item.selfIndex = items[parent].childCount;
+    items.push_back(item);
+
+    auto &parentItem = items[parent];
+    if (parentItem.childCount == parentItem.slotCapacity) {
+      auto capacity = std::max<uint32_t>(4, parentItem.slotCapacity * 2);
+      auto firstSlot = static_cast<uint32_t>(childSlots.size());
+      childSlots.resize(childSlots.size() + capacity);
+      std::copy_n(childSlots.begin() + parentItem.firstSlot, parentItem.childCount, childSlots.begin() + firstSlot);
+      parentItem.firstSlot = firstSlot;
+      parentItem.slotCapacity = capacity;
+    }
+    childSlots[parentItem.firstSlot + parentItem.childCount++] = index;
+
+    if (parentItem.childCount == kChildIndexThreshold + 1) {
+      for (uint32_t row = 0; row < parentItem.childCount; row++) {
+        auto child = childAt(parent, row);
+        childIndex.try_emplace(ChildKey{parent, items[child].matchKey}, child);
+      }
+    } else if (parentItem.childCount > kChildIndexThreshold + 1) {
+      childIndex.try_emplace(ChildKey{parent, item.matchKey}, index);
+    }
+
+    return index;
+  }
+
+  /// Adds the items and counts of other, a tree built with the same settings. Children this
+  /// tree lacks are appended in other's order, so merging the trees of consecutive runs of
+  /// stacks in order gives the same tree as building from all of them at once.
+  void merge(const HierarchyTree &other) {
+    // (item of other, matching item here)
+    std::vector<std::pair<uint32_t, uint32_t>> pending{{0, 0}};
+
+    while (!pending.empty()) {
+      auto [from, into] = pending.back();
+      pending.pop_back();
+
+      for (uint32_t row = 0; row < other.items[from].childCount; row++) {
+        auto child = other.childAt(from, row);
+        auto &childItem = other.items[child];
+
+        uint32_t matched = findChild(into, childItem);
+        if (matched == HierarchyItem::kNone) {
+          HierarchyItem item;
+          item.itemType = childItem.itemType;
+          item.matchKey = childItem.matchKey;
+          item.address = childItem.address;
+          item.functionInfo = childItem.functionInfo;
+
+          matched = addChild(into, item);
+          items[into].visibleChildren = items[into].childCount;
+        }
+
+        items[matched].count += childItem.count;
+        items[matched].selfCount += childItem.selfCount;
+        pending.emplace_back(child, matched);
+      }
+    }
+  }
+};
+
 struct TraceHierarchyModel::SymbolCache {
-  HierarchyItem root{std::numeric_limits<uint64_t>::max()};
+  HierarchyTree tree;
   uint64_t lastTraceChangeCount{0};
   ViewPerspective viewPerspective{ViewPerspective::BottomUp};
   bool showInlineFuncs { true };
+  // inclusive, samples outside of it are left out of the tree.
+  uint64_t rangeStart { 0 };
+  uint64_t rangeEnd { std::numeric_limits<uint64_t>::max() };
+  bool needsRebuild { false };
+  // a rebuild is on its way, incremental updates wait for it.
+  bool rebuildPending { false };
+  // bumped whenever the tree's counts change, address counts of older revisions aren't cached.
+  uint64_t treeRevision { 0 };
+  // id of the newest requestAddrCounts(), only its results are delivered.
+  uint64_t addrCountsRequest { 0 };
+};
+
+namespace {
+
+struct FrameKeyHash {
+  size_t operator()(const std::pair<uint64_t, uint64_t> &key) const {
+    return std::hash<uint64_t>()(key.first * 0x9e3779b97f4a7c15ULL + key.second);
+  }
+};
+
+}
+
+/// The items of (build id, pc) pairs, see resolveFrames().
+struct TraceHierarchyModel::ResolvedFrames {
+  std::vector<HierarchyItem> items;
+  // (build id, pc) -> (first item, item count)
+  std::unordered_map<std::pair<uint64_t, uint64_t>, std::pair<uint32_t, uint32_t>, FrameKeyHash> ranges;
+
+  void get(std::vector<HierarchyItem> &into, uint64_t buildId, const TraceFrame &frame) const {
+    auto [first, count] = ranges.at(std::make_pair(buildId, frame.pc));
+    into.assign(items.begin() + first, items.begin() + first + count);
+  }
+};
+
+/// What requestAddrCounts() hands to the rebuild thread, copied from the tree at the time.
+struct TraceHierarchyModel::AddrCountRequest {
+  // root (exclusive) down to the item.
+  std::vector<HierarchyItem> path;
+  uint32_t target { 0 };
+  StackTable stackTable;
+  std::vector<UniqueStack> stacks;
+  ViewPerspective viewPerspective { ViewPerspective::BottomUp };
+  bool showInlineFuncs { true };
+  uint64_t id { 0 };
+  uint64_t treeRevision { 0 };
+  std::function<void(const std::unordered_map<uint64_t, size_t> &)> done;
+};
+
+/// Items an incremental ingest() touched that views were not told about yet.
+struct TraceHierarchyModel::ChangeSet {
+  std::vector<uint32_t> inserted;
+  // existing items with new children.
+  std::vector<uint32_t> grown;
+  // existing items with new counts.
+  std::vector<uint32_t> changed;
 };
 
 TraceHierarchyModel::TraceHierarchyModel(
@@ -97,15 +340,26 @@ TraceHierarchyModel::TraceHierarchyModel(
   connect(this->traceData.get(), &TraceData::dataChanged, this, &TraceHierarchyModel::tracesChanged);
 }
 
-TraceHierarchyModel::~TraceHierarchyModel() = default;
+TraceHierarchyModel::~TraceHierarchyModel() {
+  {
+    std::lock_guard<std::mutex> _guard(rebuildLock);
+    stopRebuild = true;
+  }
+  // a rebuild in flight stops at its next generation check instead of finishing the tree.
+  ++rebuildGeneration;
+  rebuildCondition.notify_all();
+
+  if (rebuildThread.joinable())
+    rebuildThread.join();
+}
 
-QModelIndex TraceHierarchyModel::selfModelIndex(HierarchyItem *item, int column) const {
-  assert(item && "item was null");
+QModelIndex TraceHierarchyModel::selfModelIndex(uint32_t item, int column) const {
+  assert(item != HierarchyItem::kNone && "item was null");
 
-  if (item == &symbolCache->root)
+  if (item == 0)
     return QModelIndex();
 
-  return createIndex(item->selfIndex, column, static_cast<void *>(item));
+  return createIndex(symbolCache->tree.items[item].selfIndex, column, static_cast<quintptr>(item));
 }
 
 
@@ -113,26 +367,106 @@ void TraceHierarchyModel::tracesChanged() {
   updateModelTraces(symbolCache->viewPerspective, symbolCache->showInlineFuncs);
 }
 
-void TraceHierarchyModel::generateHierarchyItems(std::vector<HierarchyItem> &items, const TraceEvent &event,
-                                                 const TraceFrame &frame) const {
+void TraceHierarchyModel::generateHierarchyItems(std::vector<HierarchyItem> &items, const ResolvedAddress &resolved,
+                                                 const TraceFrame &frame, bool showInlineFuncs) const {
   items.clear();
 
-  if (auto dwarf = debugTable->loadedFiles.find(event.build_id); dwarf != debugTable->loadedFiles.end()) {
-    if (auto func = dwarf->second.resolve_address(frame.pc); func) {
+  if (resolved.function) {
+    items.emplace_back(resolved.function);
+
+    if (showInlineFuncs) {
+      for (uint32_t i = 0; i < resolved.inlineCount; i++) {
+        items.emplace_back(resolved.inlines[i]);
+      }
+    }
+
+    return;
+  }
+
+  items.emplace_back(frame.pc);
+}
+
+void TraceHierarchyModel::resolveFrames(ResolvedFrames &resolved,
+                                        const std::unordered_map<uint64_t, std::vector<uint64_t>> &pcsByBuild,
+                                        bool showInlineFuncs) const {
+  std::vector<HierarchyItem> frameItems;
+
+  const std::lock_guard<std::mutex> g(debugTable->lock);
+
+  // one sorted sweep per build, then every pc is in the cache.
+  for (auto &[buildId, pcs] : pcsByBuild) {
+    debugTable->resolveAll(buildId, pcs);
+
+    for (auto pc : pcs) {
+      auto [it, inserted] = resolved.ranges.try_emplace(std::make_pair(buildId, pc));
+      if (!inserted)
+        continue;
+
+      generateHierarchyItems(frameItems, debugTable->cached(buildId, pc), TraceFrame{pc}, showInlineFuncs);
+      it->second = std::make_pair(static_cast<uint32_t>(resolved.items.size()), static_cast<uint32_t>(frameItems.size()));
+      resolved.items.insert(resolved.items.end(), frameItems.begin(), frameItems.end());
+    }
+  }
+}
 
-      items.emplace_back(func->first);
+/// Collapses all events newer than changeIndex and within [rangeStart, rangeEnd] into their
+/// distinct (build id, stack) pairs. Stacks are returned in order of first occurrence so the
+/// tree comes out identical to walking every event one by one. Full scans of large stores are
+/// split up between up to `threads` threads.
+static std::vector<UniqueStack> collectNewStacks(const TraceEventStore &events, uint64_t changeIndex,
+                                                 uint64_t rangeStart, uint64_t rangeEnd, unsigned threads) {
+  StackCounter counter;
+
+  auto addEvent = [&](const TraceEvent &event) {
+    counter.add(event.build_id, event.stack_id, 1);
+  };
+
+  if (changeIndex == 0) {
+    auto chunkCount = events.chunkCount();
+    threads = std::max(1u, std::min<unsigned>(threads, chunkCount / kChunksPerThread));
+
+    if (threads > 1) {
+      // Count every slice of chunks on its own and fold them together in order, which keeps
+      // stacks in order of first occurrence.
+      std::vector<StackCounter> slices(threads);
+      std::vector<std::thread> workers;
+      for (unsigned i = 0; i < threads; i++) {
+        workers.emplace_back([&, i] {
+          events.forEachInChunks(chunkCount * i / threads, chunkCount * (i + 1) / threads, rangeStart, rangeEnd,
+                                 [&](const TraceEvent &event) {
+            slices[i].add(event.build_id, event.stack_id, 1);
+          });
+        });
+      }
+      for (auto &worker : workers) {
+        worker.join();
+      }
 
-      if (symbolCache->showInlineFuncs) {
-        for (auto *inlineFunc : func->second) {
-          items.emplace_back(inlineFunc);
+      counter = std::move(slices[0]);
+      for (unsigned i = 1; i < threads; i++) {
+        for (auto &stack : slices[i].stacks) {
+          counter.add(stack.buildId, stack.stackId, stack.count);
         }
       }
 
-      return;
+      return std::move(counter.stacks);
+    }
+
+    // Everything is new, binary search for the range instead of looking at every event.
+    for (auto it = events.lowerBound(rangeStart); it != events.end(); ++it) {
+      auto event = *it;
+      if (event.nanoseconds > rangeEnd)
+        break;
+      addEvent(event);
     }
+  } else {
+    events.forEachChangedSince(changeIndex, [&](const TraceEvent &event) {
+      if (event.nanoseconds >= rangeStart && event.nanoseconds <= rangeEnd)
+        addEvent(event);
+    });
   }
 
-  items.emplace_back(frame.pc);
+  return std::move(counter.stacks);
 }
 
 template <typename Container, typename Func>
@@ -149,139 +483,359 @@ static void iterateContainer(Container &container, bool reverse, Func func) {
 }
 
 void TraceHierarchyModel::updateModelTraces(ViewPerspective viewPerspective, bool showInlineFuncs) {
-  bool needsReset = viewPerspective != symbolCache->viewPerspective || showInlineFuncs != symbolCache->showInlineFuncs;
-
-  const std::lock_guard<std::mutex> g(traceData->lock);
-  const std::lock_guard<std::mutex> g2(debugTable->lock);
+  bool needsReset = symbolCache->needsRebuild || viewPerspective != symbolCache->viewPerspective ||
+                    showInlineFuncs != symbolCache->showInlineFuncs;
 
   if (needsReset) {
-    beginResetModel();
     symbolCache->viewPerspective = viewPerspective;
     symbolCache->showInlineFuncs = showInlineFuncs;
-    symbolCache->root.children.clear();
-    symbolCache->lastTraceChangeCount = 0;
+    symbolCache->needsRebuild = false;
+    requestRebuild();
+    return;
   }
 
-  std::vector<TraceFrame> frameCache;
-  std::vector<HierarchyItem> currentHierarchyItems;
-
-  for (auto &event : traceData->events) {
-    // We've ingested this event already
-    if (event.change_index <= symbolCache->lastTraceChangeCount)
-      continue;
+  // publishRebuild() picks up whatever came in while building.
+  if (symbolCache->rebuildPending)
+    return;
+
+  RebuildRequest request;
+  request.viewPerspective = symbolCache->viewPerspective;
+  request.showInlineFuncs = symbolCache->showInlineFuncs;
+  request.rangeStart = symbolCache->rangeStart;
+  request.rangeEnd = symbolCache->rangeEnd;
+  {
+    // the listener only waits for the snapshot, not for the tree.
+    const std::lock_guard<std::mutex> g(traceData->lock);
+    request.events = traceData->events.snapshot();
+    request.changeCount = traceData->change_count;
+  }
 
-    assert(event.change_index <= traceData->change_count && "event change index too high");
+  // the first batch is usually a whole imported capture, build it off the GUI thread as well.
+  if (symbolCache->lastTraceChangeCount == 0 && !request.events.empty()) {
+    requestRebuild();
+    return;
+  }
 
-    const bool displayBottomUp = viewPerspective != ViewPerspective::TopDown;
+  ingest(symbolCache->tree, request, symbolCache->lastTraceChangeCount, true);
+  symbolCache->lastTraceChangeCount = request.changeCount;
+  symbolCache->treeRevision++;
+}
 
-    // isFirstItem is defined here so that only the bottom-most item is considered `self`
-    // even in TopFunctions mode.
-    bool isFirstItem = true;
+/// Walks the items one stack adds to the tree, in the order they are nested for viewPerspective.
+/// generate(items, frame) fills in the items of a frame. visit(depth, frame, item, isSelf) is
+/// called per item, depth 0 starts a new path from the root, returning false skips the rest of
+/// the path. TopFunctions walks one path per frame.
+template<typename Item, typename Generate, typename Visit>
+static void walkStack(const TraceFrames &frames, TraceHierarchyModel::ViewPerspective viewPerspective,
+                      std::vector<TraceFrame> &frameCache, std::vector<Item> &itemCache,
+                      Generate generate, Visit visit) {
+  const bool displayBottomUp = viewPerspective != TraceHierarchyModel::ViewPerspective::TopDown;
 
-    frameCache.clear();
-    // frames are bottom-up by default, flip to top down here...
-    std::copy(event.frames.crbegin(), event.frames.crend(), std::back_inserter(frameCache));
+  // isFirstItem is defined here so that only the bottom-most item is considered `self`
+  // even in TopFunctions mode.
+  bool isFirstItem = true;
 
-    do {
-      HierarchyItem *parent = &symbolCache->root;
+  frameCache.clear();
+  // frames are bottom-up by default, flip to top down here...
+  std::copy(frames.crbegin(), frames.crend(), std::back_inserter(frameCache));
 
-      iterateContainer(frameCache, displayBottomUp, [&](auto &frame, bool hasMoreFrames) {
-        generateHierarchyItems(currentHierarchyItems, event, frame);
+  do {
+    size_t depth = 0;
+    bool stopped = false;
 
-        iterateContainer(currentHierarchyItems, displayBottomUp, [&](auto &item, bool hasMoreItems) {
-          bool isLastItem = !hasMoreFrames && !hasMoreItems;
+    iterateContainer(frameCache, displayBottomUp, [&](auto &frame, bool hasMoreFrames) {
+      if (stopped)
+        return;
 
-          // Find an existing child that matches.
-          HierarchyItem *matchedItem = nullptr;
-          for (auto &child : parent->children) {
-            if (child->targetMatch(&item)) {
-              matchedItem = child.get();
-              break;
-            }
-          }
+      generate(itemCache, frame);
 
-          // No child matches, add it
-          if (matchedItem == nullptr) {
-            item.parent = parent;
-            auto index = item.selfIndex = parent->children.size();
+      iterateContainer(itemCache, displayBottomUp, [&](auto &item, bool hasMoreItems) {
+        if (stopped)
+          return;
 
-            if (!needsReset) {
-              auto parentModelIndex = selfModelIndex(parent);
-              beginInsertRows(parentModelIndex, index, index);
-            }
+        bool isLastItem = !hasMoreFrames && !hasMoreItems;
+        bool isSelf = viewPerspective == TraceHierarchyModel::ViewPerspective::TopDown ? isLastItem : isFirstItem;
 
-            auto itemPtr = std::make_unique<HierarchyItem>(std::move(item));
-            matchedItem = itemPtr.get();
-            parent->children.push_back(std::move(itemPtr));
+        stopped = !visit(depth++, frame, item, isSelf);
+        isFirstItem = false;
+      });
+    });
 
-            if (!needsReset) {
-              endInsertRows();
-            }
-          }
+    // remove bottom most function in case we are in top functions
+    if (!frameCache.empty())
+      frameCache.pop_back();
 
-          matchedItem->count++;
-          matchedItem->addrCount[frame.pc]++;
+  } while (viewPerspective == TraceHierarchyModel::ViewPerspective::TopFunctions && !frameCache.empty());
+}
 
-          if (!needsReset) {
-            // Update the count column
-            auto itemIndex = selfModelIndex(matchedItem, 1);
-            dataChanged(itemIndex, itemIndex);
-          }
+bool TraceHierarchyModel::ingest(HierarchyTree &tree, const RebuildRequest &request, uint64_t changeIndex,
+                                 bool notify, uint64_t generation) {
+  // Only visit events we haven't ingested yet, once per distinct stack.
+  auto newStacks = collectNewStacks(request.events, changeIndex, request.rangeStart, request.rangeEnd,
+                                    notify ? 1 : std::thread::hardware_concurrency());
+  auto &stackTable = request.events.stackTable();
 
-          bool doSelfCount = viewPerspective == ViewPerspective::TopDown ? isLastItem : isFirstItem;
-          if (doSelfCount) {
-            // contribute to self count
+  tree.stackTable = stackTable;
+  for (auto &stack : newStacks) {
+    tree.counted.add(stack.buildId, stack.stackId, stack.count);
+  }
+  tree.viewPerspective = request.viewPerspective;
+  tree.showInlineFuncs = request.showInlineFuncs;
+  tree.addressCounts.clear();
+
+  // Symbolize every new frame up front, the walk below then runs without the debug table's lock.
+  ResolvedFrames resolved;
+  {
+    std::unordered_map<uint64_t, std::vector<uint64_t>> pcsByBuild;
+    for (auto &stack : newStacks) {
+      auto &pcs = pcsByBuild[stack.buildId];
+      for (auto &frame : stackTable.get(stack.stackId)) {
+        pcs.push_back(frame.pc);
+      }
+    }
 
-            matchedItem->selfCount++;
+    resolveFrames(resolved, pcsByBuild, request.showInlineFuncs);
+  }
 
-            if (!needsReset) {
-              auto itemIndex = selfModelIndex(matchedItem, 2);
-              dataChanged(itemIndex, itemIndex);
+  // Walks stacks [begin, end) into `into`, recording what changed if changes is set. Only reads
+  // resolved, so slices of the stacks can be walked on several threads at once.
+  auto addStacks = [&](HierarchyTree &into, size_t begin, size_t end, ChangeSet *changes) {
+    std::vector<TraceFrame> frameCache;
+    std::vector<HierarchyItem> currentHierarchyItems;
+
+    for (size_t i = begin; i < end; i++) {
+      if (generation != 0 && generation != rebuildGeneration)
+        return false;
+
+      auto &stack = newStacks[i];
+      const size_t weight = stack.count;
+      uint32_t parent = 0;
+
+      auto generate = [&](std::vector<HierarchyItem> &items, const TraceFrame &frame) {
+        resolved.get(items, stack.buildId, frame);
+      };
+
+      walkStack(stackTable.get(stack.stackId), request.viewPerspective, frameCache, currentHierarchyItems, generate,
+                [&](size_t depth, const TraceFrame &frame, HierarchyItem &item, bool isSelf) {
+        if (depth == 0)
+          parent = 0;
+
+        // Find an existing child that matches.
+        uint32_t matched = into.findChild(parent, item);
+
+        // No child matches, add it
+        if (matched == HierarchyItem::kNone) {
+          matched = into.addChild(parent, item);
+          auto &parentItem = into.items[parent];
+
+          if (changes) {
+            into.items[matched].pendingInsert = true;
+            changes->inserted.push_back(matched);
+
+            // rows under new items go out with them.
+            if (!parentItem.pendingInsert && !parentItem.pendingGrow) {
+              parentItem.pendingGrow = true;
+              changes->grown.push_back(parent);
             }
+          } else {
+            parentItem.visibleChildren = parentItem.childCount;
           }
+        } else if (changes && !into.items[matched].pendingInsert && !into.items[matched].pendingChange) {
+          into.items[matched].pendingChange = true;
+          changes->changed.push_back(matched);
+        }
 
-          // follow the chain...
-          parent = matchedItem;
-          isFirstItem = false;
-        });
+        auto &matchedItem = into.items[matched];
+        matchedItem.count += weight;
+        if (isSelf)
+          matchedItem.selfCount += weight;
+
+        // follow the chain...
+        parent = matched;
+        return true;
       });
+    }
+
+    return true;
+  };
 
-      // remove bottom most function in case we are in top functions
-      if (!frameCache.empty())
-        frameCache.pop_back();
+  if (notify) {
+    ChangeSet changes;
+    addStacks(tree, 0, newStacks.size(), &changes);
+    announceChanges(changes);
+    return true;
+  }
 
-    } while (viewPerspective == ViewPerspective::TopFunctions && !frameCache.empty());
+  unsigned threads = std::min<size_t>(std::max(1u, std::thread::hardware_concurrency()),
+                                      newStacks.size() / kStacksPerThread + 1);
+  if (threads == 1)
+    return addStacks(tree, 0, newStacks.size(), nullptr);
+
+  // Each thread builds a tree of its own slice of the stacks. Merged in slice order, new children
+  // land in the order they were first seen, so the result is identical to walking them one by one.
+  std::vector<HierarchyTree> slices(threads);
+  std::vector<uint8_t> finished(threads, 0);
+  std::vector<std::thread> workers;
+  for (unsigned i = 0; i < threads; i++) {
+    workers.emplace_back([&, i] {
+      finished[i] = addStacks(slices[i], newStacks.size() * i / threads, newStacks.size() * (i + 1) / threads, nullptr);
+    });
+  }
+  for (auto &worker : workers) {
+    worker.join();
   }
 
-  symbolCache->lastTraceChangeCount = traceData->change_count;
+  if (std::find(finished.begin(), finished.end(), 0) != finished.end())
+    return false;
 
-  if (needsReset) {
-    endResetModel();
+  for (auto &slice : slices) {
+    tree.merge(slice);
   }
+
+  return true;
 }
 
-QModelIndex TraceHierarchyModel::index(int row, int column, const QModelIndex &parent) const {
-  if (parent.isValid()) {
-    auto parentItem = static_cast<HierarchyItem *>(parent.internalPointer());
+void TraceHierarchyModel::announceChanges(ChangeSet &changes) {
+  auto &items = symbolCache->tree.items;
+
+  // views only reach new items through their parent's insert, so they can show all their rows right away.
+  for (auto index : changes.inserted) {
+    items[index].visibleChildren = items[index].childCount;
+    items[index].pendingInsert = false;
+  }
 
-    return createIndex(row, column, static_cast<void *>(parentItem->children.at(row).get()));
+  for (auto index : changes.grown) {
+    auto &item = items[index];
+    beginInsertRows(selfModelIndex(index), item.visibleChildren, item.childCount - 1);
+    item.visibleChildren = item.childCount;
+    endInsertRows();
+    item.pendingGrow = false;
   }
 
-  return createIndex(row, column, static_cast<void *>(symbolCache->root.children.at(row).get()));
+  // siblings were added in row order, so their indices sort the same way as their rows.
+  auto &changed = changes.changed;
+  std::sort(changed.begin(), changed.end(), [&](uint32_t a, uint32_t b) {
+    return items[a].parent != items[b].parent ? items[a].parent < items[b].parent : a < b;
+  });
+
+  for (size_t i = 0; i < changed.size();) {
+    size_t end = i + 1;
+    while (end < changed.size() && items[changed[end]].parent == items[changed[i]].parent &&
+           items[changed[end]].selfIndex == items[changed[end - 1]].selfIndex + 1) {
+      end++;
+    }
+
+    dataChanged(selfModelIndex(changed[i], 1), selfModelIndex(changed[end - 1], 2));
+    for (; i < end; i++) {
+      items[changed[i]].pendingChange = false;
+    }
+  }
 }
 
-QModelIndex TraceHierarchyModel::parent(const QModelIndex &child) const {
-  auto item = static_cast<HierarchyItem *>(child.internalPointer());
-  return selfModelIndex(item->parent);
+void TraceHierarchyModel::requestRebuild() {
+  auto request = std::make_unique<RebuildRequest>();
+  request->viewPerspective = symbolCache->viewPerspective;
+  request->showInlineFuncs = symbolCache->showInlineFuncs;
+  request->rangeStart = symbolCache->rangeStart;
+  request->rangeEnd = symbolCache->rangeEnd;
+  request->generation = ++rebuildGeneration;
+  {
+    const std::lock_guard<std::mutex> g(traceData->lock);
+    request->events = traceData->events.snapshot();
+    request->changeCount = traceData->change_count;
+  }
+
+  symbolCache->rebuildPending = true;
+
+  {
+    std::lock_guard<std::mutex> _guard(rebuildLock);
+    if (!rebuildThread.joinable())
+      rebuildThread = std::thread(&TraceHierarchyModel::rebuildLoop, this);
+
+    pendingRebuild = std::move(request);
+  }
+  rebuildCondition.notify_one();
 }
 
-int TraceHierarchyModel::rowCount(const QModelIndex &parent) const {
-  if (parent.isValid()) {
-    auto item = static_cast<HierarchyItem *>(parent.internalPointer());
-    return item->children.size();
+void TraceHierarchyModel::rebuildLoop() {
+  std::unique_lock<std::mutex> queueGuard(rebuildLock);
+
+  while (true) {
+    rebuildCondition.wait(queueGuard, [&] { return stopRebuild || pendingRebuild || pendingAddrCounts; });
+    if (stopRebuild)
+      return;
+
+    // someone clicked and is waiting for these, they go before rebuilds.
+    if (pendingAddrCounts) {
+      std::shared_ptr<AddrCountRequest> countRequest = std::move(pendingAddrCounts);
+      queueGuard.unlock();
+
+      auto counts = std::make_shared<std::unordered_map<uint64_t, size_t>>(countAddresses(*countRequest));
+      QMetaObject::invokeMethod(this, [this, countRequest, counts] {
+        publishAddrCounts(*countRequest, *counts);
+      }, Qt::QueuedConnection);
+
+      countRequest.reset();
+      queueGuard.lock();
+      continue;
+    }
+
+    auto request = std::move(pendingRebuild);
+    queueGuard.unlock();
+
+    auto tree = std::make_shared<HierarchyTree>();
+    bool finished = ingest(*tree, *request, 0, false, request->generation);
+
+    if (finished) {
+      auto generation = request->generation;
+      auto changeCount = request->changeCount;
+      QMetaObject::invokeMethod(this, [this, tree, generation, changeCount] {
+        publishRebuild(tree, generation, changeCount);
+      }, Qt::QueuedConnection);
+    }
+
+    // drop the snapshot's hold on the chunks before waiting again.
+    request.reset();
+    queueGuard.lock();
   }
+}
+
+void TraceHierarchyModel::publishRebuild(std::shared_ptr<HierarchyTree> tree, uint64_t generation,
+                                         uint64_t changeCount) {
+  // another rebuild was requested since, its tree is on the way.
+  if (generation != rebuildGeneration)
+    return;
+
+  beginResetModel();
+  // the old tree goes with the lambda that brought the new one.
+  std::swap(symbolCache->tree, *tree);
+  symbolCache->lastTraceChangeCount = changeCount;
+  symbolCache->rebuildPending = false;
+  symbolCache->treeRevision++;
+  endResetModel();
+
+  // catch up on what came in while the tree was built.
+  updateModelTraces(symbolCache->viewPerspective, symbolCache->showInlineFuncs);
+}
+
+QModelIndex TraceHierarchyModel::index(int row, int column, const QModelIndex &parent) const {
+  auto parentItem = parent.isValid() ? static_cast<uint32_t>(parent.internalId()) : 0;
+  auto &tree = symbolCache->tree;
+
+  if (row < 0 || static_cast<uint32_t>(row) >= tree.items[parentItem].visibleChildren)
+    return QModelIndex();
+
+  return createIndex(row, column, static_cast<quintptr>(tree.childAt(parentItem, row)));
+}
+
+QModelIndex TraceHierarchyModel::parent(const QModelIndex &child) const {
+  auto item = static_cast<uint32_t>(child.internalId());
+  return selfModelIndex(symbolCache->tree.items[item].parent);
+}
 
-  return symbolCache->root.children.size();
+int TraceHierarchyModel::rowCount(const QModelIndex &parent) const {
+  auto item = parent.isValid() ? static_cast<uint32_t>(parent.internalId()) : 0;
+  return static_cast<int>(symbolCache->tree.items[item].visibleChildren);
 }
 
 int TraceHierarchyModel::columnCount(const QModelIndex &parent) const {
@@ -308,7 +862,7 @@ QVariant TraceHierarchyModel::headerData(int section, Qt::Orientation orientatio
 }
 
 QVariant TraceHierarchyModel::data(const QModelIndex &index, int role) const {
-  auto item = static_cast<HierarchyItem *>(index.internalPointer());
+  auto *item = &symbolCache->tree.items[index.internalId()];
 
   switch (role) {
     case Qt::DisplayRole:
@@ -346,6 +900,21 @@ void TraceHierarchyModel::setShowInlineFuncs(bool showInlineFuncs) {
   updateModelTraces(symbolCache->viewPerspective, showInlineFuncs);
 }
 
+void TraceHierarchyModel::setTimeRange(uint64_t start, uint64_t end) {
+  if (start == symbolCache->rangeStart && end == symbolCache->rangeEnd)
+    return;
+
+  symbolCache->rangeStart = start;
+  symbolCache->rangeEnd = end;
+  symbolCache->needsRebuild = true;
+  updateModelTraces(symbolCache->viewPerspective, symbolCache->showInlineFuncs);
+}
+
+void TraceHierarchyModel::symbolsChanged() {
+  symbolCache->needsRebuild = true;
+  updateModelTraces(symbolCache->viewPerspective, symbolCache->showInlineFuncs);
+}
+
 TraceHierarchyModel::ViewPerspective TraceHierarchyModel::getViewPerspective() {
   return symbolCache->viewPerspective;
 }
@@ -355,18 +924,94 @@ bool TraceHierarchyModel::getShowInlineFuncs() {
 }
 
 AbstractFunctionInfo *TraceHierarchyModel::getFunctionInfo(const QModelIndex &index) const {
-  auto item = static_cast<HierarchyItem *>(index.internalPointer());
-  return item->itemType == ItemType::Function ? item->functionInfo : nullptr;
+  auto &item = symbolCache->tree.items[index.internalId()];
+  return item.itemType == ItemType::Function ? item.functionInfo : nullptr;
 }
 
-const std::unordered_map<uint64_t, size_t> &TraceHierarchyModel::getAddrCounts(const QModelIndex &index) const {
-  auto item = static_cast<HierarchyItem *>(index.internalPointer());
-  return item->addrCount;
+void TraceHierarchyModel::requestAddrCounts(
+        const QModelIndex &index, std::function<void(const std::unordered_map<uint64_t, size_t> &)> done) {
+  auto &tree = symbolCache->tree;
+  auto target = static_cast<uint32_t>(index.internalId());
+  auto id = ++symbolCache->addrCountsRequest;
+
+  if (auto it = tree.addressCounts.find(target); it != tree.addressCounts.end()) {
+    done(it->second);
+    return;
+  }
+
+  auto request = std::make_unique<AddrCountRequest>();
+  for (auto item = target; item != 0; item = tree.items[item].parent) {
+    request->path.push_back(tree.items[item]);
+  }
+  std::reverse(request->path.begin(), request->path.end());
+  request->target = target;
+  request->stackTable = tree.stackTable;
+  request->stacks = tree.counted.stacks;
+  request->viewPerspective = tree.viewPerspective;
+  request->showInlineFuncs = tree.showInlineFuncs;
+  request->id = id;
+  request->treeRevision = symbolCache->treeRevision;
+  request->done = std::move(done);
+
+  {
+    std::lock_guard<std::mutex> _guard(rebuildLock);
+    if (!rebuildThread.joinable())
+      rebuildThread = std::thread(&TraceHierarchyModel::rebuildLoop, this);
+
+    pendingAddrCounts = std::move(request);
+  }
+  rebuildCondition.notify_one();
 }
 
+std::unordered_map<uint64_t, size_t> TraceHierarchyModel::countAddresses(const AddrCountRequest &request) const {
+  ResolvedFrames resolved;
+  {
+    std::unordered_map<uint64_t, std::vector<uint64_t>> pcsByBuild;
+    for (auto &stack : request.stacks) {
+      auto &pcs = pcsByBuild[stack.buildId];
+      for (auto &frame : request.stackTable.get(stack.stackId)) {
+        pcs.push_back(frame.pc);
+      }
+    }
+
+    resolveFrames(resolved, pcsByBuild, request.showInlineFuncs);
+  }
+
+  // Items only match one child of their parent, so a stack passes through the target exactly
+  // when its items match the path from the root down to it.
+  auto &path = request.path;
+  std::unordered_map<uint64_t, size_t> counts;
+  std::vector<TraceFrame> frameCache;
+  std::vector<HierarchyItem> itemCache;
+
+  for (auto &stack : request.stacks) {
+    auto generate = [&](std::vector<HierarchyItem> &items, const TraceFrame &frame) {
+      resolved.get(items, stack.buildId, frame);
+    };
 
+    walkStack(request.stackTable.get(stack.stackId), request.viewPerspective, frameCache, itemCache, generate,
+              [&](size_t depth, const TraceFrame &frame, HierarchyItem &item, bool) {
+      if (depth >= path.size() || !path[depth].targetMatch(item))
+        return false;
 
+      if (depth + 1 < path.size())
+        return true;
 
+      counts[frame.pc] += stack.count;
+      return false;
+    });
+  }
 
+  return counts;
+}
 
+void TraceHierarchyModel::publishAddrCounts(const AddrCountRequest &request,
+                                            const std::unordered_map<uint64_t, size_t> &counts) {
+  // counts of an older tree would be handed out for items that count more by now.
+  if (request.treeRevision == symbolCache->treeRevision)
+    symbolCache->tree.addressCounts.emplace(request.target, counts);
 
+  // only the newest selection is still waiting.
+  if (request.id == symbolCache->addrCountsRequest)
+    request.done(counts);
+}
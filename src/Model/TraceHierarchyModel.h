@@ -5,7 +5,12 @@
 #ifndef TRACEVIEWER2_TRACEHIERARCHYMODEL_H
 #define TRACEVIEWER2_TRACEHIERARCHYMODEL_H
 
+#include <atomic>
+#include <condition_variable>
+#include <functional>
 #include <memory>
+#include <mutex>
+#include <thread>
 
 #include <QAbstractItemModel>
 
@@ -18,6 +23,11 @@
 class TraceHierarchyModel : public QAbstractItemModel {
   struct SymbolCache;
   struct HierarchyItem;
+  struct HierarchyTree;
+  struct RebuildRequest;
+  struct ChangeSet;
+  struct ResolvedFrames;
+  struct AddrCountRequest;
 
 public:
   enum class ViewPerspective {
@@ -32,6 +42,19 @@ private:
   std::shared_ptr<TraceData> traceData;
   std::shared_ptr<DebugTable> debugTable;
   std::unique_ptr<SymbolCache> symbolCache;
+
+  /// Full rebuilds run on this thread from a snapshot of the events, see requestRebuild().
+  std::thread rebuildThread;
+  std::mutex rebuildLock;
+  std::condition_variable rebuildCondition;
+  // only the newest request is kept, older ones would be thrown away anyway.
+  std::unique_ptr<RebuildRequest> pendingRebuild;
+  // counted before any rebuild, see requestAddrCounts().
+  std::unique_ptr<AddrCountRequest> pendingAddrCounts;
+  bool stopRebuild { false };
+  // bumped for every requested rebuild, trees of older ones are dropped.
+  std::atomic<uint64_t> rebuildGeneration { 0 };
+
 public:
   TraceHierarchyModel(std::shared_ptr<TraceData> traceData, std::shared_ptr<DebugTable> debugTable,
                       QObject *parent = nullptr);
@@ -42,11 +65,43 @@ private slots:
   void tracesChanged();
 
 protected:
-  void generateHierarchyItems(std::vector<HierarchyItem> &items, const TraceEvent &event, const TraceFrame &frame) const;
+  void generateHierarchyItems(std::vector<HierarchyItem> &items, const ResolvedAddress &resolved,
+                              const TraceFrame &frame, bool showInlineFuncs) const;
+
+  /// Symbolizes the pcs of each build and generates their items. Holds the debug table's lock
+  /// only while doing so, the items stay valid once lazily loaded units replace inline chains.
+  void resolveFrames(ResolvedFrames &resolved, const std::unordered_map<uint64_t, std::vector<uint64_t>> &pcsByBuild,
+                     bool showInlineFuncs) const;
 
   void updateModelTraces(ViewPerspective viewPerspective, bool showInlineFuncs);
 
-  QModelIndex selfModelIndex(HierarchyItem *item, int column = 0) const;
+  /// Adds the events of request newer than changeIndex to tree. Only emits model signals if
+  /// notify is set, without it this may run on any thread and spreads large builds over
+  /// several. Stops early and returns false once generation is no longer the newest rebuild,
+  /// 0 never stops.
+  bool ingest(HierarchyTree &tree, const RebuildRequest &request, uint64_t changeIndex, bool notify,
+              uint64_t generation = 0);
+
+  /// Announces what an incremental ingest() changed: one ranged insert per parent that gained
+  /// rows and one ranged dataChanged per run of changed siblings.
+  void announceChanges(ChangeSet &changes);
+
+  /// Builds a new tree on the rebuild thread and swaps it in once done. Until then the
+  /// current tree stays visible and is not updated.
+  void requestRebuild();
+
+  void rebuildLoop();
+
+  /// Swaps in a tree built by rebuildLoop() with a single model reset.
+  void publishRebuild(std::shared_ptr<HierarchyTree> tree, uint64_t generation, uint64_t changeCount);
+
+  /// Samples per pc of the stacks through request's item, runs on the rebuild thread.
+  std::unordered_map<uint64_t, size_t> countAddresses(const AddrCountRequest &request) const;
+
+  /// Caches counts from countAddresses() and hands them to whoever asked, if they still wait.
+  void publishAddrCounts(const AddrCountRequest &request, const std::unordered_map<uint64_t, size_t> &counts);
+
+  QModelIndex selfModelIndex(uint32_t item, int column = 0) const;
 
 public:
   QModelIndex index(int row, int column, const QModelIndex &parent) const override;
@@ -65,13 +120,23 @@ public:
 
   void setShowInlineFuncs(bool showInlineFuncs);
 
+  /// Only count samples taken between start and end (inclusive). Rebuilds the whole tree.
+  void setTimeRange(uint64_t start, uint64_t end);
+
+  /// Symbols of a loaded file changed, e.g. lazily parsed units came in. Rebuilds the whole tree.
+  void symbolsChanged();
+
   ViewPerspective getViewPerspective();
 
   bool getShowInlineFuncs();
 
   AbstractFunctionInfo *getFunctionInfo(const QModelIndex &index) const;
 
-  const std::unordered_map<uint64_t, size_t> &getAddrCounts(const QModelIndex &index) const;
+  /// Samples of the item per pc. Counted on the rebuild thread from the distinct stacks of the tree
+  /// and cached until the tree changes. done is called on the GUI thread, unless addresses of
+  /// another item are requested first.
+  void requestAddrCounts(const QModelIndex &index,
+                         std::function<void(const std::unordered_map<uint64_t, size_t> &)> done);
 
 };
 
@@ -0,0 +1,65 @@
+//
+// Created by Will Gulian on 1/11/21.
+//
+
+#ifndef TRACEVIEWER2_SPSCRING_H
+#define TRACEVIEWER2_SPSCRING_H
+
+#include <atomic>
+#include <cstddef>
+#include <memory>
+
+/// Lock-free single producer, single consumer ring buffer of fixed size slots.
+///
+/// Slots are written and read in place: the producer fills writeSlot(0..n) and then
+/// publishes them with commitWrite(n), the consumer reads readSlot(0..n) and hands
+/// them back with commitRead(n). This lets recvmmsg() receive straight into the ring.
+template<typename T, size_t Capacity>
+class SpscRing {
+  static_assert(Capacity && (Capacity & (Capacity - 1)) == 0, "capacity must be a power of two");
+
+  std::unique_ptr<T[]> buffer;
+
+  // only written by the consumer
+  alignas(64) std::atomic<size_t> head{0};
+  // only written by the producer
+  alignas(64) std::atomic<size_t> tail{0};
+
+public:
+  SpscRing() : buffer(std::make_unique<T[]>(Capacity)) {}
+
+  SpscRing(const SpscRing &) = delete;
+
+  SpscRing &operator=(const SpscRing &) = delete;
+
+  // Producer side
+
+  [[nodiscard]] size_t writeAvailable() const {
+    return Capacity - (tail.load(std::memory_order_relaxed) - head.load(std::memory_order_acquire));
+  }
+
+  T &writeSlot(size_t index) {
+    return buffer[(tail.load(std::memory_order_relaxed) + index) & (Capacity - 1)];
+  }
+
+  void commitWrite(size_t count) {
+    tail.store(tail.load(std::memory_order_relaxed) + count, std::memory_order_release);
+  }
+
+  // Consumer side
+
+  [[nodiscard]] size_t readAvailable() const {
+    return tail.load(std::memory_order_acquire) - head.load(std::memory_order_relaxed);
+  }
+
+  T &readSlot(size_t index) {
+    return buffer[(head.load(std::memory_order_relaxed) + index) & (Capacity - 1)];
+  }
+
+  void commitRead(size_t count) {
+    head.store(head.load(std::memory_order_relaxed) + count, std::memory_order_release);
+  }
+};
+
+
+#endif //TRACEVIEWER2_SPSCRING_H
@@ -0,0 +1,92 @@
+//
+// Created by Will Gulian on 1/10/21.
+//
+
+#include <algorithm>
+
+#include "StackTable.h"
+
+static uint64_t hashFrames(TraceFrames stack) {
+  uint64_t hash = 0xcbf29ce484222325ULL ^ stack.size();
+  for (auto &frame : stack) {
+    hash ^= frame.pc + 0x9e3779b97f4a7c15ULL + (hash << 6) + (hash >> 2);
+  }
+  return hash;
+}
+
+static bool equalFrames(TraceFrames a, TraceFrames b) {
+  return std::equal(a.begin(), a.end(), b.begin(), b.end(), [](auto &x, auto &y) {
+    return x.pc == y.pc;
+  });
+}
+
+StackTable::StackTable(const StackTable &other) {
+  *this = other;
+}
+
+StackTable &StackTable::operator=(const StackTable &other) {
+  if (this == &other)
+    return *this;
+
+  frameBlocks = other.frameBlocks;
+  entryBlocks = other.entryBlocks;
+  stackCount = other.stackCount;
+
+  // other keeps appending to the blocks, this table only reads what is there now.
+  framesUsed = 0;
+  frameBlockSize = 0;
+  index.clear();
+  ownsBlocks = false;
+
+  return *this;
+}
+
+void StackTable::takeOwnership() {
+  // the last entry block is still being filled by the table this was copied from.
+  if (stackCount % kStacksPerBlock != 0) {
+    std::shared_ptr<Entry[]> copy(new Entry[kStacksPerBlock]);
+    std::copy_n(entryBlocks.back().get(), stackCount % kStacksPerBlock, copy.get());
+    entryBlocks.back() = std::move(copy);
+  }
+
+  index.reserve(stackCount);
+  for (uint32_t id = 0; id < stackCount; id++) {
+    index.emplace(hashFrames(get(id)), id);
+  }
+
+  ownsBlocks = true;
+}
+
+uint32_t StackTable::intern(TraceFrames stack) {
+  if (!ownsBlocks)
+    takeOwnership();
+
+  auto hash = hashFrames(stack);
+  auto [first, last] = index.equal_range(hash);
+  for (auto it = first; it != last; ++it) {
+    if (equalFrames(get(it->second), stack))
+      return it->second;
+  }
+
+  if (stack.size() > frameBlockSize - framesUsed) {
+    frameBlockSize = std::max(kFramesPerBlock, stack.size());
+    frameBlocks.emplace_back(new TraceFrame[frameBlockSize]);
+    framesUsed = 0;
+  }
+
+  auto *frames = frameBlocks.empty() ? nullptr : frameBlocks.back().get() + framesUsed;
+  std::copy(stack.begin(), stack.end(), frames);
+  framesUsed += stack.size();
+
+  auto id = static_cast<uint32_t>(stackCount++);
+  if (id % kStacksPerBlock == 0)
+    entryBlocks.emplace_back(new Entry[kStacksPerBlock]);
+  entryBlocks.back()[id % kStacksPerBlock] = Entry{frames, static_cast<uint32_t>(stack.size())};
+
+  index.emplace(hash, id);
+  return id;
+}
+
+void StackTable::clear() {
+  *this = StackTable();
+}
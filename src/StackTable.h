@@ -0,0 +1,107 @@
+//
+// Created by Will Gulian on 1/10/21.
+//
+
+#ifndef TRACEVIEWER2_STACKTABLE_H
+#define TRACEVIEWER2_STACKTABLE_H
+
+#include <cstdint>
+#include <iterator>
+#include <memory>
+#include <unordered_map>
+#include <vector>
+
+struct TraceFrame {
+  uint64_t pc;
+};
+
+/// Non-owning view over the frames of one event.
+class TraceFrames {
+  const TraceFrame *data_ { nullptr };
+  size_t size_ { 0 };
+
+public:
+  using const_iterator = const TraceFrame *;
+  using const_reverse_iterator = std::reverse_iterator<const TraceFrame *>;
+
+  TraceFrames() = default;
+
+  TraceFrames(const TraceFrame *data, size_t size) : data_(data), size_(size) {}
+
+  TraceFrames(const std::vector<TraceFrame> &frames) : data_(frames.data()), size_(frames.size()) {}
+
+  [[nodiscard]] size_t size() const { return size_; }
+
+  [[nodiscard]] bool empty() const { return size_ == 0; }
+
+  const TraceFrame &operator[](size_t index) const { return data_[index]; }
+
+  [[nodiscard]] const_iterator begin() const { return data_; }
+
+  [[nodiscard]] const_iterator end() const { return data_ + size_; }
+
+  [[nodiscard]] const_reverse_iterator crbegin() const { return const_reverse_iterator(end()); }
+
+  [[nodiscard]] const_reverse_iterator crend() const { return const_reverse_iterator(begin()); }
+};
+
+/// Deduplicates frame lists. Every distinct call stack is stored once and
+/// identified by a dense 32-bit id, ids are handed out in first-seen order.
+///
+/// Stacks are appended to fixed size blocks that never move or change once written,
+/// so copying a table only copies the block lists. A copy sees the stacks that existed
+/// when it was made while the original keeps appending to the same blocks.
+class StackTable {
+public:
+  static constexpr size_t kFramesPerBlock = 64 * 1024;
+  static constexpr size_t kStacksPerBlock = 4096;
+
+private:
+  struct Entry {
+    const TraceFrame *frames;
+    uint32_t count;
+  };
+
+  std::vector<std::shared_ptr<TraceFrame[]>> frameBlocks;
+  std::vector<std::shared_ptr<Entry[]>> entryBlocks;
+  size_t stackCount { 0 };
+  // room in frameBlocks.back(), zero if this table may not append to it.
+  size_t framesUsed { 0 };
+  size_t frameBlockSize { 0 };
+
+  // Maps the hash of a stack to its ids. Only kept by the table appending to the blocks,
+  // a copy builds its own and moves to blocks of its own the first time it interns.
+  std::unordered_multimap<uint64_t, uint32_t> index;
+  bool ownsBlocks { true };
+
+  void takeOwnership();
+
+public:
+  StackTable() = default;
+
+  StackTable(const StackTable &other);
+
+  StackTable &operator=(const StackTable &other);
+
+  StackTable(StackTable &&other) noexcept = default;
+
+  StackTable &operator=(StackTable &&other) noexcept = default;
+
+  /// Returns the id of this frame list, adding it if it has not been seen before.
+  uint32_t intern(TraceFrames stack);
+
+  [[nodiscard]] TraceFrames get(uint32_t id) const {
+    auto &entry = entryBlocks[id / kStacksPerBlock][id % kStacksPerBlock];
+    return TraceFrames(entry.frames, entry.count);
+  }
+
+  [[nodiscard]] size_t size() const {
+    return stackCount;
+  }
+
+  /// Starts over with empty blocks, copies keep the old ones.
+  void clear();
+};
+
+
+#endif //TRACEVIEWER2_STACKTABLE_H
@@ -0,0 +1,253 @@
+//
+// Created by Will Gulian on 1/14/21.
+//
+
+#include <algorithm>
+#include <iostream>
+#include <limits>
+#include <unordered_map>
+
+#include <QDir>
+#include <QFileInfo>
+#include <QStandardPaths>
+
+#include <capnp/message.h>
+#include <capnp/serialize.h>
+#include <kj/exception.h>
+
+#include "SymbolIndex.h"
+#include "QtOutputStream.h"
+#include "schema/symbolindex.capnp.h"
+
+// Inline trees are nested lists, so they count against the nesting limit twice per level.
+static constexpr int kNestingLimit = 1024;
+
+QString SymbolIndex::pathFor(const std::vector<uint8_t> &buildId) {
+  if (buildId.empty())
+    return QString();
+
+  QByteArray id(reinterpret_cast<const char *>(buildId.data()), static_cast<int>(buildId.size()));
+
+  QString path = QStandardPaths::writableLocation(QStandardPaths::CacheLocation);
+  path += "/symbols/";
+  path += QString(id.toHex());
+  path += ".symidx";
+  return path;
+}
+
+static capnp::Text::Reader textOf(std::string_view str) {
+  // pooled strings are NUL terminated, as Text requires.
+  return capnp::Text::Reader(str.data(), str.size());
+}
+
+static void writeRanges(capnp::List<symbol_index::Range>::Builder cRanges,
+                        const std::vector<std::pair<uint64_t, uint64_t>> &ranges) {
+  for (size_t i = 0; i < ranges.size(); i++) {
+    cRanges[i].setLow(ranges[i].first);
+    cRanges[i].setHigh(ranges[i].second);
+  }
+}
+
+static void writeInlines(capnp::List<symbol_index::InlinedFunction>::Builder cInlines,
+                         const std::vector<std::unique_ptr<InlinedFunctionInfo>> &inlines) {
+  for (size_t i = 0; i < inlines.size(); i++) {
+    auto &function = *inlines[i];
+    auto cInline = cInlines[i];
+
+    cInline.setDieOffset(function.die_offset);
+    cInline.setOriginOffset(function.origin_offset);
+    cInline.setDepth(function.depth);
+    writeRanges(cInline.initRanges(function.ranges.size()), function.ranges);
+
+    if (function.sourceLine) {
+      cInline.setCallFile(textOf(function.sourceLine->first));
+      cInline.setCallLine(function.sourceLine->second);
+    }
+
+    writeInlines(cInline.initInlines(function.inline_functions.size()), function.inline_functions);
+  }
+}
+
+bool SymbolIndex::write(const QString &path, const DwarfInfo &info) {
+  if (path.isEmpty())
+    return false;
+
+  QDir().mkpath(QFileInfo(path).absolutePath());
+
+  ::capnp::MallocMessageBuilder message;
+
+  auto cIndex = message.initRoot<symbol_index::SymbolIndex>();
+  cIndex.setVersion(kVersion);
+  cIndex.setBuildId(kj::arrayPtr(info.buildId.data(), info.buildId.size()));
+
+  auto cFunctions = cIndex.initFunctions(info.functions.size());
+  for (size_t i = 0; i < info.functions.size(); i++) {
+    auto &function = *info.functions[i];
+    auto cFunction = cFunctions[i];
+
+    cFunction.setDieOffset(function.die_offset);
+    cFunction.setName(textOf(function.name));
+    cFunction.setFullName(textOf(function.full_name));
+    cFunction.setLinkageName(textOf(function.linkageName));
+    writeRanges(cFunction.initRanges(function.ranges.size()), function.ranges);
+    writeInlines(cFunction.initInlines(function.inline_functions.size()), function.inline_functions);
+  }
+
+  auto &files = info.lineFiles;
+
+  auto cFiles = cIndex.initFiles(files.size());
+  for (size_t i = 0; i < files.size(); i++) {
+    auto &file = files[i];
+    cFiles[i].setCuIndex(file.cu_index);
+    cFiles[i].setFileIndex(file.file_index);
+    cFiles[i].setName(textOf(file.name));
+  }
+
+  auto lines = info.decodeLines();
+  auto cLines = cIndex.initLines(lines.size());
+  for (size_t i = 0; i < lines.size(); i++) {
+    auto &line = lines[i];
+    cLines[i].setAddress(line.address);
+    cLines[i].setFileIndex(line.fileIndex);
+    cLines[i].setLine(line.line);
+  }
+
+  // Write next to the index and move it into place, so a concurrent load never maps half an index.
+  QString tempPath = path + ".tmp";
+  {
+    QFile file(tempPath);
+    if (!file.open(QIODevice::WriteOnly))
+      return false;
+
+    QtOutputStream stream(file);
+    ::capnp::writeMessage(stream, message);
+  }
+
+  QFile::remove(path);
+  return QFile::rename(tempPath, path);
+}
+
+/// A view into the mapped index, which lives as long as what is read from it.
+static std::string_view readText(capnp::Text::Reader text) {
+  return std::string_view(text.cStr(), text.size());
+}
+
+static void readRanges(capnp::List<symbol_index::Range>::Reader cRanges,
+                       std::vector<std::pair<uint64_t, uint64_t>> &ranges) {
+  ranges.reserve(cRanges.size());
+  for (auto cRange : cRanges) {
+    ranges.emplace_back(cRange.getLow(), cRange.getHigh());
+  }
+}
+
+static void readInlines(capnp::List<symbol_index::InlinedFunction>::Reader cInlines,
+                        std::vector<std::unique_ptr<InlinedFunctionInfo>> &inlines) {
+  inlines.reserve(cInlines.size());
+  for (auto cInline : cInlines) {
+    auto function = std::make_unique<InlinedFunctionInfo>();
+    function->die_offset = cInline.getDieOffset();
+    function->origin_offset = cInline.getOriginOffset();
+    function->depth = static_cast<int>(cInline.getDepth());
+    readRanges(cInline.getRanges(), function->ranges);
+    function->sourceLine = std::make_pair(readText(cInline.getCallFile()), cInline.getCallLine());
+
+    readInlines(cInline.getInlines(), function->inline_functions);
+    inlines.push_back(std::move(function));
+  }
+}
+
+std::optional<SymbolIndex::Contents> SymbolIndex::read(const QString &path, const std::vector<uint8_t> &buildId) {
+  if (path.isEmpty() || !QFile::exists(path))
+    return std::nullopt;
+
+  auto file = std::make_unique<QFile>(path);
+  if (!file->open(QIODevice::ReadOnly))
+    return std::nullopt;
+
+  auto size = static_cast<size_t>(file->size());
+  // mappings are page aligned, so the words can be read in place.
+  auto data = file->map(0, file->size());
+  if (!data || size % sizeof(capnp::word) != 0)
+    return std::nullopt;
+
+  capnp::ReaderOptions options;
+  options.traversalLimitInWords = std::numeric_limits<uint64_t>::max();
+  options.nestingLimit = kNestingLimit;
+
+  Contents contents;
+
+  try {
+    capnp::FlatArrayMessageReader reader(
+            kj::arrayPtr(reinterpret_cast<const capnp::word *>(data), size / sizeof(capnp::word)), options);
+
+    auto cIndex = reader.getRoot<symbol_index::SymbolIndex>();
+    if (cIndex.getVersion() != kVersion)
+      return std::nullopt;
+
+    auto cBuildId = cIndex.getBuildId();
+    if (cBuildId.size() != buildId.size() || !std::equal(cBuildId.begin(), cBuildId.end(), buildId.begin()))
+      return std::nullopt;
+
+    auto cFunctions = cIndex.getFunctions();
+    contents.functions.reserve(cFunctions.size());
+    for (auto cFunction : cFunctions) {
+      auto function = std::make_unique<ConcreteFunctionInfo>();
+      function->die_offset = cFunction.getDieOffset();
+      function->name = readText(cFunction.getName());
+      function->full_name = readText(cFunction.getFullName());
+      function->linkageName = readText(cFunction.getLinkageName());
+      readRanges(cFunction.getRanges(), function->ranges);
+      readInlines(cFunction.getInlines(), function->inline_functions);
+
+      contents.functions.push_back(std::move(function));
+    }
+
+    auto cFiles = cIndex.getFiles();
+    contents.lineTable.files.reserve(cFiles.size());
+    for (auto cFile : cFiles) {
+      contents.lineTable.files.push_back(
+              DwarfInfo::LineFileInfo{cFile.getCuIndex(), cFile.getFileIndex(), readText(cFile.getName()), 0});
+    }
+
+    auto cLines = cIndex.getLines();
+    contents.lineTable.lines.reserve(cLines.size());
+    for (auto cLine : cLines) {
+      contents.lineTable.lines.push_back(DwarfInfo::LineInfo{cLine.getAddress(), cLine.getFileIndex(), cLine.getLine()});
+    }
+  } catch (kj::Exception &e) {
+    std::cout << "ignoring symbol index " << path.toStdString() << ": " << e.getDescription().cStr() << "\n";
+    return std::nullopt;
+  }
+
+  {
+    // link all the inline functions to their definition
+
+    std::unordered_map<Dwarf_Off, ConcreteFunctionInfo *> func_lookup;
+    for (auto &func : contents.functions) {
+      func_lookup[func->die_offset] = func.get();
+    }
+
+    std::vector<InlinedFunctionInfo *> inline_func_stack;
+    for (auto &func : contents.functions) {
+      for (auto &inline_func : func->inline_functions) {
+        inline_func_stack.push_back(inline_func.get());
+      }
+    }
+
+    while (!inline_func_stack.empty()) {
+      auto ptr = inline_func_stack.back();
+      inline_func_stack.pop_back();
+
+      auto it = func_lookup.find(ptr->origin_offset);
+      if (it != func_lookup.end())
+        ptr->origin_fn = it->second;
+
+      for (auto &inline_func : ptr->inline_functions) {
+        inline_func_stack.push_back(inline_func.get());
+      }
+    }
+  }
+
+  contents.file = std::move(file);
+  return contents;
+}
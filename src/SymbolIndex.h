@@ -0,0 +1,42 @@
+//
+// Created by Will Gulian on 1/14/21.
+//
+
+#ifndef TRACEVIEWER2_SYMBOLINDEX_H
+#define TRACEVIEWER2_SYMBOLINDEX_H
+
+#include <memory>
+#include <optional>
+#include <vector>
+
+#include <QFile>
+#include <QString>
+
+#include "DwarfInfo.h"
+
+/// On-disk cache of what DwarfLoader::load() extracts from a binary: functions, their
+/// inline trees and the line table. Indices are keyed by the GNU build id, so a binary
+/// that has not been rebuilt is read back from a memory mapping instead of walking its DIEs.
+struct SymbolIndex {
+  /// Bump whenever the schema or what the loader extracts changes, indices of other versions are ignored.
+  static constexpr uint32_t kVersion = 1;
+
+  struct Contents {
+    std::vector<std::unique_ptr<ConcreteFunctionInfo>> functions;
+    DwarfInfo::LineTable lineTable;
+    // the mapped index, names and paths point into it.
+    std::unique_ptr<QFile> file;
+  };
+
+  /// Where the index for a build lives in the user's cache directory. Empty if there is no build id.
+  static QString pathFor(const std::vector<uint8_t> &buildId);
+
+  /// Writes the index of info to path, replacing any index already there.
+  static bool write(const QString &path, const DwarfInfo &info);
+
+  /// Reads the index at path. Returns nothing if there is none, or it is for another build or version.
+  static std::optional<Contents> read(const QString &path, const std::vector<uint8_t> &buildId);
+};
+
+
+#endif //TRACEVIEWER2_SYMBOLINDEX_H
@@ -0,0 +1,50 @@
+//
+// Created by Will Gulian on 1/15/21.
+//
+
+#include <algorithm>
+#include <cstring>
+#include <iterator>
+
+#include "SymbolStringPool.h"
+
+std::string_view SymbolStringPool::intern(std::string_view str) {
+  if (auto it = strings.find(str); it != strings.end())
+    return *it;
+
+  auto length = str.size() + 1;
+  char *data;
+
+  if (length > kBlockSize / 4) {
+    // Long strings get a block of their own instead of wasting what is left of the current one.
+    blocks.push_back(std::make_unique<char[]>(length));
+    data = blocks.back().get();
+  } else {
+    if (length > remaining) {
+      blocks.push_back(std::make_unique<char[]>(kBlockSize));
+      cursor = blocks.back().get();
+      remaining = kBlockSize;
+    }
+
+    data = cursor;
+    cursor += length;
+    remaining -= length;
+  }
+
+  memcpy(data, str.data(), str.size());
+  data[str.size()] = '\0';
+
+  std::string_view pooled(data, str.size());
+  strings.insert(pooled);
+  return pooled;
+}
+
+void SymbolStringPool::merge(SymbolStringPool &&other) {
+  strings.insert(other.strings.begin(), other.strings.end());
+  other.strings.clear();
+
+  std::move(other.blocks.begin(), other.blocks.end(), std::back_inserter(blocks));
+  other.blocks.clear();
+  other.cursor = nullptr;
+  other.remaining = 0;
+}
@@ -0,0 +1,64 @@
+//
+// Created by Will Gulian on 1/15/21.
+//
+
+#ifndef TRACEVIEWER2_SYMBOLSTRINGPOOL_H
+#define TRACEVIEWER2_SYMBOLSTRINGPOOL_H
+
+#include <memory>
+#include <string_view>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+#include <QString>
+
+/// Deduplicated storage for symbol names and file paths.
+///
+/// Strings are copied into large arena blocks once and handed out as views. Every
+/// view is followed by a NUL and stays valid for the life of the pool, also after
+/// the pool is moved or merged into another one.
+class SymbolStringPool {
+  static constexpr size_t kBlockSize = 64 * 1024;
+
+  std::vector<std::unique_ptr<char[]>> blocks;
+  char *cursor { nullptr };
+  size_t remaining { 0 };
+  std::unordered_set<std::string_view> strings;
+
+public:
+  SymbolStringPool() = default;
+
+  SymbolStringPool(const SymbolStringPool &other) = delete;
+
+  SymbolStringPool(SymbolStringPool &&other) noexcept
+          : blocks(std::move(other.blocks)), cursor(std::exchange(other.cursor, nullptr)),
+            remaining(std::exchange(other.remaining, 0)), strings(std::move(other.strings)) {}
+
+  SymbolStringPool &operator=(SymbolStringPool &&other) noexcept {
+    blocks = std::move(other.blocks);
+    cursor = std::exchange(other.cursor, nullptr);
+    remaining = std::exchange(other.remaining, 0);
+    strings = std::move(other.strings);
+    return *this;
+  }
+
+  /// The pooled copy of str, str is copied in the first time it is seen.
+  std::string_view intern(std::string_view str);
+
+  /// Takes over the storage of other. Views into other stay valid, following intern()
+  /// calls on this pool also find the strings of other.
+  void merge(SymbolStringPool &&other);
+
+  [[nodiscard]] size_t size() const {
+    return strings.size();
+  }
+};
+
+/// Pooled strings are only turned into a QString when they are displayed.
+inline QString toQString(std::string_view str) {
+  return QString::fromUtf8(str.data(), static_cast<int>(str.size()));
+}
+
+
+#endif //TRACEVIEWER2_SYMBOLSTRINGPOOL_H
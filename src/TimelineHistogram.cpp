@@ -0,0 +1,151 @@
+//
+// Created by Will Gulian on 1/13/21.
+//
+
+#include <algorithm>
+
+#include "TimelineHistogram.h"
+
+TimelineHistogram::TimelineHistogram(const TimelineHistogram &other) {
+  *this = other;
+}
+
+TimelineHistogram &TimelineHistogram::operator=(const TimelineHistogram &other) {
+  if (this == &other)
+    return *this;
+
+  std::scoped_lock g(lock, other.lock);
+  levels = other.levels;
+  firstLevel = other.firstLevel;
+  oldest = other.oldest;
+  newest = other.newest;
+  total = other.total;
+  return *this;
+}
+
+void TimelineHistogram::add(uint64_t nanoseconds) {
+  const std::lock_guard<std::mutex> g(lock);
+  addLocked(nanoseconds);
+}
+
+void TimelineHistogram::add(const TraceBatch &batch) {
+  const std::lock_guard<std::mutex> g(lock);
+  for (size_t i = 0; i < batch.size(); i++) {
+    addLocked(batch.timestampAt(i));
+  }
+}
+
+void TimelineHistogram::clear() {
+  const std::lock_guard<std::mutex> g(lock);
+  levels.clear();
+  firstLevel = 0;
+  oldest = std::numeric_limits<uint64_t>::max();
+  newest = std::numeric_limits<uint64_t>::min();
+  total = 0;
+}
+
+bool TimelineHistogram::range(uint64_t &oldestOut, uint64_t &newestOut) const {
+  const std::lock_guard<std::mutex> g(lock);
+  oldestOut = oldest;
+  newestOut = newest;
+  return total != 0;
+}
+
+uint64_t TimelineHistogram::resolution() const {
+  const std::lock_guard<std::mutex> g(lock);
+  return uint64_t(1) << (kBaseShift + firstLevel);
+}
+
+void TimelineHistogram::countRanges(const std::vector<uint64_t> &boundaries, std::vector<uint64_t> &counts) const {
+  const std::lock_guard<std::mutex> g(lock);
+
+  counts.assign(boundaries.empty() ? 0 : boundaries.size() - 1, 0);
+  if (total == 0)
+    return;
+
+  auto shift = kBaseShift + firstLevel;
+  for (size_t i = 0; i < counts.size(); i++) {
+    counts[i] = countLocked(boundaries[i] >> shift, boundaries[i + 1] >> shift);
+  }
+}
+
+void TimelineHistogram::addLocked(uint64_t nanoseconds) {
+  oldest = std::min(oldest, nanoseconds);
+  newest = std::max(newest, nanoseconds);
+  total++;
+
+  if (levels.empty())
+    levels.resize(1);
+
+  for (unsigned level = firstLevel; level < levels.size(); level++) {
+    auto index = nanoseconds >> (kBaseShift + level);
+    auto &l = levels[level];
+
+    if (l.counts.empty()) {
+      l.origin = index;
+      l.counts.push_back(0);
+    }
+
+    auto first = std::min(l.origin, index);
+    auto last = std::max(l.origin + l.counts.size() - 1, index);
+
+    if (last - first >= kMaxLevelBuckets) {
+      // Too wide to keep at this resolution, fall back to the next coarser level.
+      if (level + 1 == levels.size())
+        buildParent(level);
+
+      levels[level] = Level{};
+      firstLevel = level + 1;
+      continue;
+    }
+
+    if (index < l.origin) {
+      l.counts.insert(l.counts.begin(), l.origin - index, 0);
+      l.origin = index;
+    } else if (index >= l.origin + l.counts.size()) {
+      l.counts.resize(index - l.origin + 1, 0);
+    }
+
+    l.counts[index - l.origin]++;
+  }
+
+  // The top level always has a single bucket holding everything.
+  while (levels.back().counts.size() > 1) {
+    buildParent(levels.size() - 1);
+  }
+}
+
+void TimelineHistogram::buildParent(unsigned level) {
+  Level parent;
+  {
+    auto &child = levels[level];
+    parent.origin = child.origin >> 1;
+    parent.counts.resize(((child.origin + child.counts.size() - 1) >> 1) - parent.origin + 1, 0);
+    for (size_t i = 0; i < child.counts.size(); i++) {
+      parent.counts[((child.origin + i) >> 1) - parent.origin] += child.counts[i];
+    }
+  }
+
+  levels.push_back(std::move(parent));
+}
+
+uint64_t TimelineHistogram::countLocked(uint64_t from, uint64_t to) const {
+  // Clamping to the populated buckets guarantees the range is used up by the top level.
+  auto shift = kBaseShift + firstLevel;
+  from = std::max(from, oldest >> shift);
+  to = std::min(to, (newest >> shift) + 1);
+
+  uint64_t count = 0;
+  for (unsigned level = firstLevel; from < to && level < levels.size(); level++) {
+    auto &l = levels[level];
+    if (from & 1)
+      count += l.at(from++);
+    if (to & 1)
+      count += l.at(--to);
+
+    from >>= 1;
+    to >>= 1;
+  }
+
+  return count;
+}
@@ -0,0 +1,83 @@
+//
+// Created by Will Gulian on 1/13/21.
+//
+
+#ifndef TRACEVIEWER2_TIMELINEHISTOGRAM_H
+#define TRACEVIEWER2_TIMELINEHISTOGRAM_H
+
+#include <cstdint>
+#include <limits>
+#include <mutex>
+#include <vector>
+
+#include "TraceEventStore.h"
+
+/// Event counts per power-of-two time bucket, kept up to date as events are inserted.
+///
+/// Level 0 counts events per 2^kBaseShift ns, every level above halves the resolution.
+/// The number of events in a range is the sum of O(log n) buckets taken from the
+/// levels, so the timeline can be drawn without walking the events or taking the trace lock.
+///
+/// Has its own lock, all methods are thread-safe.
+class TimelineHistogram {
+  struct Level {
+    // bucket index of counts[0].
+    uint64_t origin { 0 };
+    std::vector<uint32_t> counts;
+
+    [[nodiscard]] uint32_t at(uint64_t index) const {
+      return index >= origin && index - origin < counts.size() ? counts[index - origin] : 0;
+    }
+  };
+
+  mutable std::mutex lock;
+
+  // levels below firstLevel have been dropped because they would be too large, they stay empty.
+  std::vector<Level> levels;
+  unsigned firstLevel { 0 };
+
+  uint64_t oldest { std::numeric_limits<uint64_t>::max() };
+  uint64_t newest { std::numeric_limits<uint64_t>::min() };
+  uint64_t total { 0 };
+
+public:
+  /// Level 0 buckets are about a microsecond wide, fine enough for zoomed in views. Long
+  /// captures outgrow kMaxLevelBuckets there and fall back to coarser levels.
+  static constexpr unsigned kBaseShift = 10;
+  /// Finest levels are dropped rather than grown past this many buckets, e.g. when a
+  /// capture has outlying timestamps.
+  static constexpr size_t kMaxLevelBuckets = 1 << 22;
+
+  TimelineHistogram() = default;
+
+  TimelineHistogram(const TimelineHistogram &other);
+
+  TimelineHistogram &operator=(const TimelineHistogram &other);
+
+  void add(uint64_t nanoseconds);
+
+  void add(const TraceBatch &batch);
+
+  void clear();
+
+  /// Timestamps of the oldest and newest event, returns false if there are no events.
+  bool range(uint64_t &oldestOut, uint64_t &newestOut) const;
+
+  /// Width in ns of the finest level still available, ranges are rounded to it.
+  [[nodiscard]] uint64_t resolution() const;
+
+  /// Sets counts[i] to the number of events in [boundaries[i], boundaries[i + 1]).
+  /// Boundaries must be ascending, they are rounded down to resolution().
+  void countRanges(const std::vector<uint64_t> &boundaries, std::vector<uint64_t> &counts) const;
+
+private:
+  void addLocked(uint64_t nanoseconds);
+
+  /// Appends a new level made by summing pairs of buckets of level.
+  void buildParent(unsigned level);
+
+  [[nodiscard]] uint64_t countLocked(uint64_t from, uint64_t to) const;
+};
+
+
+#endif //TRACEVIEWER2_TIMELINEHISTOGRAM_H
@@ -2,15 +2,20 @@
 // Created by Will Gulian on 11/26/20.
 //
 
+#include <atomic>
 #include <cstdio>
+#include <cstring>
 #include <iostream>
-#include <unordered_map>
+#include <thread>
 
 #include <QFile>
 
 #include <capnp/message.h>
+#include <capnp/serialize.h>
 #include <capnp/serialize-packed.h>
+#include <kj/exception.h>
 #include <kj/io.h>
+#include <kj/memory.h>
 
 #include "TraceData.h"
 #include "schema/tracestreaming.capnp.h"
@@ -26,6 +31,7 @@ TraceData::TraceData(const TraceData &other) : events(), change_count(0) {
   const std::lock_guard<std::mutex> g(lock);
   events = other.events;
   change_count = other.change_count;
+  histogram = other.histogram;
 }
 
 void TraceData::initialize() {
@@ -40,99 +46,74 @@ void TraceData::initialize() {
 
 void TraceData::insert(TraceEvent event) {
   const std::lock_guard<std::mutex> g(lock);
+  histogram.add(event.nanoseconds);
   event.change_index = ++change_count;
   markChange();
 
-  auto it = events.end();
-  while (it != events.begin()) {
-    it--;
+  events.insert(event);
+}
 
-    if (it->nanoseconds < event.nanoseconds) {
-      it++;
-      events.insert(it, event);
-      return;
-    }
-  }
+void TraceData::insertBatch(const TraceBatch &batch) {
+  if (batch.empty())
+    return;
 
-  events.insert(events.begin(), event);
+  const std::lock_guard<std::mutex> g(lock);
+  // under the trace lock as well, so what the histogram counts is always in the store.
+  histogram.add(batch);
+  events.insertBatch(batch, change_count + 1);
+  change_count += batch.size();
+  markChange();
 }
 
-static void parseTraceGroup(TraceData *data, net_trace::TraceGroup::Reader &root) {
-  std::cout << "build id: " << root.getBuildId() << "\n";
+static void parseTraceGroup(TraceBatch &batch, const net_trace::TraceGroup::Reader &root) {
+  auto buildId = root.getBuildId();
 
   auto events = root.getEvents();
   for (auto it = events.begin(); it != events.end(); ++it) {
-    TraceEvent event{};
-    event.nanoseconds = it->getTimestamp();
-    event.build_id = root.getBuildId();
-    event.event_index = it->getEventIndex();
+    batch.beginEvent(it->getTimestamp(), buildId, it->getEventIndex());
 
     auto frames = it->getFrames();
     for (auto it2 = frames.begin(); it2 != frames.end(); ++it2) {
-      TraceFrame frame{};
-      frame.pc = it2->getPc();
-
-      event.frames.push_back(frame);
+      batch.addFrame(it2->getPc());
     }
-
-    data->insert(event);
   }
 }
 
-void TraceData::parse(uint8_t *data, size_t len) {
-  if (len < 8) {
-    std::cout << "received packet with size:" << len << std::endl;
-    return;
-  }
+bool TraceData::decode(uint8_t *data, size_t len, TraceBatch &batch) {
+  if (len < 8)
+    return false;
 
-  kj::ArrayInputStream dataStream(kj::ArrayPtr(data, len));
-  capnp::PackedMessageReader reader(dataStream);
+  // decode into a scratch batch so a packet that fails half way adds nothing.
+  TraceBatch packet;
 
-  net_trace::TraceGroup::Reader root = reader.getRoot<net_trace::TraceGroup>();
-  parseTraceGroup(this, root);
-}
+  try {
+    kj::ArrayInputStream dataStream(kj::ArrayPtr(data, len));
+    capnp::PackedMessageReader reader(dataStream);
 
-void TraceData::exportToFile(QString name) {
-  const std::lock_guard<std::mutex> g(lock);
-
-  std::unordered_map<uint64_t, size_t> buildIds;
-
-  for (auto &event : events) {
-    buildIds[event.build_id]++;
+    net_trace::TraceGroup::Reader root = reader.getRoot<net_trace::TraceGroup>();
+    parseTraceGroup(packet, root);
+  } catch (kj::Exception &e) {
+    return false;
   }
 
-  ::capnp::MallocMessageBuilder message;
-
-  net_trace::SavedTraces::Builder saved = message.initRoot<net_trace::SavedTraces>();
-  auto cGroups = saved.initGroups(buildIds.size());
-
-  size_t groupIdx = 0;
-  for (auto [buildId, count] : buildIds) {
-    auto cGroup = cGroups[groupIdx++];
-    cGroup.setBuildId(buildId);
-
-    auto evIt = events.begin();
-
-    auto cEvents = cGroup.initEvents(count);
-    for (size_t eventIdx = 0; eventIdx < count; eventIdx++) {
-      auto cEvent = cEvents[eventIdx];
-
-      // find a matching event.
-      while (evIt->build_id != buildId) evIt++;
-
-      auto &event = *evIt;
-
-      cEvent.setEventIndex(event.event_index);
-      cEvent.setTimestamp(event.nanoseconds);
+  batch.append(std::move(packet));
+  return true;
+}
 
-      auto cFrames = cEvent.initFrames(event.frames.size());
-      for (size_t frameIdx = 0; frameIdx < event.frames.size(); frameIdx++) {
-        cFrames[frameIdx].setPc(event.frames[frameIdx].pc);
-      }
+bool TraceData::parse(uint8_t *data, size_t len) {
+  TraceBatch batch;
+  if (!decode(data, len, batch))
+    return false;
 
-      evIt++;
-    }
+  insertBatch(batch);
+  return true;
+}
 
+void TraceData::exportToFile(QString name, TraceFileFormat format) {
+  TraceEventStore snapshot;
+  {
+    const std::lock_guard<std::mutex> g(lock);
+    snapshot = events.snapshot();
   }
 
   QFile file(name);
@@ -140,8 +121,24 @@ void TraceData::exportToFile(QString name) {
     return;
 
   QtOutputStream stream(file);
-  ::capnp::writePackedMessage(stream, message);
+  TraceFileWriter writer(stream, format);
 
+  for (const auto &event : snapshot) {
+    writer.add(event);
+  }
+
+  writer.flush();
+}
+
+/// InputStreamMessageReader reads segments lazily on first access, which is not safe
+/// once several threads share the reader. Touch every segment up front.
+static void loadAllSegments(capnp::MessageReader &reader) {
+  for (uint32_t id = 0; reader.getSegment(id).begin() != nullptr; id++) {
+  }
+}
+
+static bool hasMagic(const uchar *data, size_t size, const char (&magic)[8]) {
+  return size >= sizeof(magic) && memcmp(data, magic, sizeof(magic)) == 0;
 }
 
 void TraceData::importFromFile(QString name) {
@@ -149,30 +146,89 @@ void TraceData::importFromFile(QString name) {
   if (!file.open(QIODevice::ReadOnly))
     return;
 
+  auto size = static_cast<size_t>(file.size());
   auto data = file.map(0, file.size());
+  if (!data)
+    return;
 
-  kj::ArrayInputStream dataStream(kj::ArrayPtr(data, file.size()));
-  capnp::PackedMessageReader reader(dataStream);
+  // Saved captures are routinely larger than the default traversal limit.
+  capnp::ReaderOptions options;
+  options.traversalLimitInWords = std::numeric_limits<uint64_t>::max();
+
+  // the stream must outlive the readers reading from it.
+  kj::Own<kj::ArrayInputStream> dataStream;
+  std::vector<kj::Own<capnp::MessageReader>> readers;
+  std::vector<net_trace::TraceGroup::Reader> groups;
+
+  try {
+    if (hasMagic(data, size, kMappedTraceMagic)) {
+      // Unpacked messages are read in place straight out of the mapping, nothing is copied.
+      auto words = kj::arrayPtr(reinterpret_cast<const capnp::word *>(data + sizeof(kMappedTraceMagic)),
+                                (size - sizeof(kMappedTraceMagic)) / sizeof(capnp::word));
+      while (words.size() > 0) {
+        auto reader = kj::heap<capnp::FlatArrayMessageReader>(words, options);
+        words = kj::arrayPtr(reader->getEnd(), words.end());
+
+        groups.push_back(reader->getRoot<net_trace::TraceGroup>());
+        readers.push_back(std::move(reader));
+      }
+    } else if (hasMagic(data, size, kPackedTraceMagic)) {
+      dataStream = kj::heap<kj::ArrayInputStream>(kj::ArrayPtr(data + sizeof(kPackedTraceMagic), size - sizeof(kPackedTraceMagic)));
+      while (dataStream->tryGetReadBuffer().size() > 0) {
+        // the next message starts where this one ends, so it has to be read completely first.
+        auto reader = kj::heap<capnp::PackedMessageReader>(*dataStream, options);
+        loadAllSegments(*reader);
+
+        groups.push_back(reader->getRoot<net_trace::TraceGroup>());
+        readers.push_back(std::move(reader));
+      }
+    } else {
+      dataStream = kj::heap<kj::ArrayInputStream>(kj::ArrayPtr(data, size));
+      auto reader = kj::heap<capnp::PackedMessageReader>(*dataStream, options);
+      loadAllSegments(*reader);
 
-  net_trace::SavedTraces::Reader root = reader.getRoot<net_trace::SavedTraces>();
+      for (auto group : reader->getRoot<net_trace::SavedTraces>().getGroups()) {
+        groups.push_back(group);
+      }
+      readers.push_back(std::move(reader));
+    }
+  } catch (kj::Exception &e) {
+    // A flight recording may have been cut off mid message, keep everything before that.
+    std::cout << "import stopped early: " << e.getDescription().cStr() << "\n";
+  }
+
+  // Decode groups in parallel, each into its own batch, then merge them in file order.
+  std::vector<TraceBatch> batches(groups.size());
+  std::atomic<size_t> nextGroup{0};
+
+  auto worker = [&] {
+    for (size_t i = nextGroup++; i < batches.size(); i = nextGroup++) {
+      parseTraceGroup(batches[i], groups[i]);
+    }
+  };
 
-  for (auto group : root.getGroups()) {
-    parseTraceGroup(this, group);
+  size_t threadCount = std::min<size_t>(std::max(1u, std::thread::hardware_concurrency()), batches.size());
+  std::vector<std::thread> threads;
+  for (size_t i = 1; i < threadCount; i++) {
+    threads.emplace_back(worker);
+  }
+  worker();
+  for (auto &thread : threads) {
+    thread.join();
   }
 
-}
+  TraceBatch all;
+  for (auto &batch : batches) {
+    all.append(std::move(batch));
+  }
 
-void TraceData::generateTimeline(Timeline &timeline, int width) {
-  const std::lock_guard<std::mutex> g(lock);
+  insertBatch(all);
+}
 
+void TraceData::generateTimeline(Timeline &timeline, int width, uint64_t start, uint64_t end) {
   timeline.newest_timestamp = std::numeric_limits<uint64_t>::min();
   timeline.oldest_timestamp = std::numeric_limits<uint64_t>::max();
 
-  for (auto &event : events) {
-    timeline.oldest_timestamp = std::min(timeline.oldest_timestamp, event.nanoseconds);
-    timeline.newest_timestamp = std::max(timeline.newest_timestamp, event.nanoseconds);
-  }
-
   timeline.columns.clear();
   {
     TimelineEntry entry;
@@ -180,17 +236,55 @@ void TraceData::generateTimeline(Timeline &timeline, int width) {
     timeline.columns.resize(width, entry);
   }
 
-  if (events.empty())
+  if (width <= 0 || !histogram.range(timeline.oldest_timestamp, timeline.newest_timestamp))
     return;
 
-  for (auto &event : events) {
-    size_t x = timeline.timeToIndex(event.nanoseconds);
-    auto &entry = timeline.columns.at(x);
-    entry.count++;
-    entry.oldest_timestamp = std::min(entry.oldest_timestamp, event.nanoseconds);
-    entry.newest_timestamp = std::max(entry.newest_timestamp, event.nanoseconds);
+  timeline.oldest_timestamp = std::max(timeline.oldest_timestamp, start);
+  timeline.newest_timestamp = std::min(timeline.newest_timestamp, end);
+  if (!timeline.valid())
+    return;
+
+  auto span = timeline.newest_timestamp - timeline.oldest_timestamp + 1;
+
+  // Column edges are rounded to histogram buckets. Only ranges a few buckets wide are visibly
+  // off, and they hold few enough events to count them directly.
+  if (span < 8 * histogram.resolution()) {
+    const std::lock_guard<std::mutex> g(lock);
+
+    for (auto it = events.lowerBound(timeline.oldest_timestamp); it != events.end(); ++it) {
+      auto event = *it;
+      if (event.nanoseconds > timeline.newest_timestamp)
+        break;
+
+      size_t x = timeline.timeToIndex(event.nanoseconds);
+      auto &entry = timeline.columns.at(x);
+      entry.count++;
+      entry.oldest_timestamp = std::min(entry.oldest_timestamp, event.nanoseconds);
+      entry.newest_timestamp = std::max(entry.newest_timestamp, event.nanoseconds);
+    }
+    return;
   }
 
+  // First timestamp of each column, i.e. the smallest t with timeToIndex(t) == i.
+  std::vector<uint64_t> boundaries(width + 1);
+  for (size_t i = 0; i <= static_cast<size_t>(width); i++) {
+    boundaries[i] = timeline.oldest_timestamp + (i * span + width - 1) / width;
+  }
+  // rounding down must not cut off the newest bucket.
+  boundaries.back() = std::numeric_limits<uint64_t>::max();
+
+  std::vector<uint64_t> counts;
+  histogram.countRanges(boundaries, counts);
+
+  for (size_t i = 0; i < counts.size(); i++) {
+    auto &entry = timeline.columns[i];
+    entry.count = static_cast<int>(counts[i]);
+    if (entry.count) {
+      entry.oldest_timestamp = boundaries[i];
+      // the last boundary is open ended, selections must not reach past the newest event.
+      entry.newest_timestamp = std::min(boundaries[i + 1] - 1, timeline.newest_timestamp);
+    }
+  }
 }
 
 void TraceData::debounceTriggered() {
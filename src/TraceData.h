@@ -11,17 +11,9 @@
 #include <QString>
 #include <QTimer>
 
-struct TraceFrame {
-  uint64_t pc;
-};
-
-struct TraceEvent {
-  uint64_t nanoseconds;
-  uint64_t build_id;
-  uint64_t event_index;
-  uint64_t change_index;
-  std::vector<TraceFrame> frames;
-};
+#include "TimelineHistogram.h"
+#include "TraceEventStore.h"
+#include "TraceFileWriter.h"
 
 struct TimelineEntry {
   int count { 0 };
@@ -58,8 +50,10 @@ class TraceData : public QObject {
 public:
   std::mutex lock{};
   // sorted by nanoseconds
-  std::vector<TraceEvent> events{};
+  TraceEventStore events{};
   uint64_t change_count { 0 };
+  // has its own lock, can be read without holding `lock`. Only updated while holding `lock`.
+  TimelineHistogram histogram{};
 
 public:
   TraceData();
@@ -76,13 +70,26 @@ signals:
 public:
   void insert(TraceEvent event);
 
-  void parse(uint8_t *data, size_t len);
+  /// Merges a whole batch under a single lock acquisition with a single change notification.
+  void insertBatch(const TraceBatch &batch);
+
+  /// Decodes one packed TraceGroup message and appends its events to batch.
+  /// Does not touch any TraceData, returns false if the message is malformed.
+  static bool decode(uint8_t *data, size_t len, TraceBatch &batch);
+
+  /// Decodes one packed TraceGroup message and inserts it. Returns false if it is malformed.
+  bool parse(uint8_t *data, size_t len);
 
-  void exportToFile(QString file);
+  /// Writes a snapshot of the capture, the lock is only held while taking the snapshot.
+  void exportToFile(QString file, TraceFileFormat format = TraceFileFormat::Packed);
 
+  /// Accepts both streamed formats as well as a single packed SavedTraces message.
   void importFromFile(QString file);
 
-  void generateTimeline(Timeline &timeline, int width);
+  /// Buckets the events between start and end (inclusive) into width columns.
+  /// Uses the histogram unless the range only covers a few of its buckets.
+  void generateTimeline(Timeline &timeline, int width, uint64_t start = 0,
+                        uint64_t end = std::numeric_limits<uint64_t>::max());
 
 private slots:
   /// Timer has elapsed -> forward to dataChanged().
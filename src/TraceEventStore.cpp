@@ -0,0 +1,168 @@
+//
+// Created by Will Gulian on 1/9/21.
+//
+
+#include <algorithm>
+#include <atomic>
+#include <numeric>
+
+#include "TraceEventStore.h"
+
+void TraceEventStore::Chunk::reserve(size_t count) {
+  nanoseconds.reserve(count);
+  buildIds.reserve(count);
+  eventIndices.reserve(count);
+  changeIndices.reserve(count);
+  stackIds.reserve(count);
+}
+
+void TraceEventStore::Chunk::insert(size_t index, const TraceEvent &event, uint32_t stackId) {
+  nanoseconds.insert(nanoseconds.begin() + index, event.nanoseconds);
+  buildIds.insert(buildIds.begin() + index, event.build_id);
+  eventIndices.insert(eventIndices.begin() + index, event.event_index);
+  changeIndices.insert(changeIndices.begin() + index, event.change_index);
+  stackIds.insert(stackIds.begin() + index, stackId);
+
+  maxChangeIndex = std::max(maxChangeIndex, event.change_index);
+}
+
+template<typename T>
+static void moveColumnTail(std::vector<T> &from, size_t index, std::vector<T> &into) {
+  into.insert(into.end(), from.begin() + index, from.end());
+  from.erase(from.begin() + index, from.end());
+}
+
+void TraceEventStore::Chunk::moveTail(size_t index, Chunk &into) {
+  moveColumnTail(nanoseconds, index, into.nanoseconds);
+  moveColumnTail(buildIds, index, into.buildIds);
+  moveColumnTail(eventIndices, index, into.eventIndices);
+  moveColumnTail(changeIndices, index, into.changeIndices);
+  moveColumnTail(stackIds, index, into.stackIds);
+
+  maxChangeIndex = changeIndices.empty() ? 0 : *std::max_element(changeIndices.begin(), changeIndices.end());
+  into.maxChangeIndex = into.changeIndices.empty() ? 0 : *std::max_element(into.changeIndices.begin(), into.changeIndices.end());
+}
+
+void TraceEventStore::insert(const TraceEvent &event) {
+  eventCount++;
+
+  auto stackId = stacks.intern(event.frames);
+
+  // Fast path, event is in order.
+  if (chunks.empty() || chunks.back()->nanoseconds.back() <= event.nanoseconds) {
+    if (chunks.empty() || chunks.back()->size() >= kChunkCapacity) {
+      chunks.push_back(std::make_shared<Chunk>());
+      chunks.back()->reserve(kChunkCapacity);
+    }
+
+    auto &chunk = mutableChunk(chunks.size() - 1);
+    chunk.insert(chunk.size(), event, stackId);
+    return;
+  }
+
+  // Late event, find the first chunk that ends after it.
+  auto chunkIt = std::upper_bound(chunks.begin(), chunks.end(), event.nanoseconds, [](auto ns, const auto &chunk) {
+    return ns < chunk->nanoseconds.back();
+  });
+
+  auto chunkIndex = static_cast<size_t>(chunkIt - chunks.begin());
+  auto &chunk = mutableChunk(chunkIndex);
+  auto it = std::upper_bound(chunk.nanoseconds.begin(), chunk.nanoseconds.end(), event.nanoseconds);
+  chunk.insert(it - chunk.nanoseconds.begin(), event, stackId);
+
+  if (chunk.size() >= 2 * kChunkCapacity) {
+    splitChunk(chunkIndex);
+  }
+}
+
+void TraceEventStore::insertBatch(const TraceBatch &batch, uint64_t firstChangeIndex) {
+  // Insert in time order so that everything newer than the store is a plain append.
+  std::vector<size_t> order(batch.size());
+  std::iota(order.begin(), order.end(), 0);
+  std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+    return batch.timestampAt(a) < batch.timestampAt(b);
+  });
+
+  for (auto index : order) {
+    auto event = batch.eventAt(index);
+    event.change_index = firstChangeIndex + index;
+    insert(event);
+  }
+}
+
+void TraceEventStore::clear() {
+  chunks.clear();
+  stacks.clear();
+  eventCount = 0;
+}
+
+TraceEventStore::const_iterator TraceEventStore::lowerBound(uint64_t nanoseconds) const {
+  auto chunkIt = std::lower_bound(chunks.begin(), chunks.end(), nanoseconds, [](const auto &chunk, auto ns) {
+    return chunk->nanoseconds.back() < ns;
+  });
+
+  if (chunkIt == chunks.end())
+    return end();
+
+  auto &chunk = **chunkIt;
+  auto it = std::lower_bound(chunk.nanoseconds.begin(), chunk.nanoseconds.end(), nanoseconds);
+
+  return const_iterator(this, chunkIt - chunks.begin(), it - chunk.nanoseconds.begin());
+}
+
+/// Whether a snapshot still shares ptr. All copies of a store are made under the trace lock,
+/// so a use count of one can't race with a new snapshot being taken. Snapshots are released
+/// on other threads though: use_count() is a relaxed load, the fence orders everything
+/// after it behind the release that dropped the count to one.
+template<typename T>
+static bool isShared(const std::shared_ptr<T> &ptr) {
+  if (ptr.use_count() > 1)
+    return true;
+
+  std::atomic_thread_fence(std::memory_order_acquire);
+  return false;
+}
+
+TraceEventStore::Chunk &TraceEventStore::mutableChunk(size_t index) {
+  auto &chunk = chunks[index];
+  if (isShared(chunk)) {
+    chunk = std::make_shared<Chunk>(*chunk);
+  }
+  return *chunk;
+}
+
+void TraceEventStore::splitChunk(size_t index) {
+  auto upper = std::make_shared<Chunk>();
+  upper->reserve(kChunkCapacity * 2);
+  mutableChunk(index).moveTail(chunks[index]->size() / 2, *upper);
+
+  chunks.insert(chunks.begin() + index + 1, std::move(upper));
+}
+
+void TraceBatch::append(TraceBatch &&other) {
+  if (empty()) {
+    *this = std::move(other);
+    other.clear();
+    return;
+  }
+
+  auto frameBase = frames.size();
+
+  nanoseconds.insert(nanoseconds.end(), other.nanoseconds.begin(), other.nanoseconds.end());
+  buildIds.insert(buildIds.end(), other.buildIds.begin(), other.buildIds.end());
+  eventIndices.insert(eventIndices.end(), other.eventIndices.begin(), other.eventIndices.end());
+  for (auto offset : other.frameOffsets) {
+    frameOffsets.push_back(frameBase + offset);
+  }
+  frames.insert(frames.end(), other.frames.begin(), other.frames.end());
+
+  other.clear();
+}
+
+void TraceBatch::clear() {
+  nanoseconds.clear();
+  buildIds.clear();
+  eventIndices.clear();
+  frameOffsets.clear();
+  frames.clear();
+}
@@ -0,0 +1,284 @@
+//
+// Created by Will Gulian on 1/9/21.
+//
+
+#ifndef TRACEVIEWER2_TRACEEVENTSTORE_H
+#define TRACEVIEWER2_TRACEEVENTSTORE_H
+
+#include <algorithm>
+#include <cstdint>
+#include <iterator>
+#include <memory>
+#include <vector>
+
+#include "StackTable.h"
+
+/// A single sample. This is a lightweight view, `frames` points into the store
+/// it was read from and is only valid while that store is locked and unmodified.
+struct TraceEvent {
+  uint64_t nanoseconds;
+  uint64_t build_id;
+  uint64_t event_index;
+  uint64_t change_index;
+  // id of `frames` in the store's StackTable, not read by insert().
+  uint32_t stack_id;
+  TraceFrames frames;
+};
+
+/// Events decoded outside of the trace lock, waiting to be merged into a store in one go.
+/// Laid out like a store chunk with its own frame pool. Events are in arrival order.
+class TraceBatch {
+  std::vector<uint64_t> nanoseconds;
+  std::vector<uint64_t> buildIds;
+  std::vector<uint64_t> eventIndices;
+  std::vector<uint64_t> frameOffsets;
+  std::vector<TraceFrame> frames;
+
+public:
+  /// Starts a new event, following addFrame() calls append to it.
+  void beginEvent(uint64_t timestamp, uint64_t buildId, uint64_t eventIndex) {
+    nanoseconds.push_back(timestamp);
+    buildIds.push_back(buildId);
+    eventIndices.push_back(eventIndex);
+    frameOffsets.push_back(frames.size());
+  }
+
+  void addFrame(uint64_t pc) {
+    frames.push_back(TraceFrame{pc});
+  }
+
+  /// Moves all events of other to the end of this batch.
+  void append(TraceBatch &&other);
+
+  void clear();
+
+  [[nodiscard]] size_t size() const {
+    return nanoseconds.size();
+  }
+
+  [[nodiscard]] bool empty() const {
+    return nanoseconds.empty();
+  }
+
+  [[nodiscard]] uint64_t timestampAt(size_t index) const {
+    return nanoseconds[index];
+  }
+
+  /// change_index and stack_id are not known until the event is in a store and are left zero.
+  [[nodiscard]] TraceEvent eventAt(size_t index) const {
+    auto frameEnd = index + 1 < frameOffsets.size() ? frameOffsets[index + 1] : frames.size();
+    return TraceEvent {
+            nanoseconds[index],
+            buildIds[index],
+            eventIndices[index],
+            0,
+            0,
+            TraceFrames(frames.data() + frameOffsets[index], frameEnd - frameOffsets[index]),
+    };
+  }
+};
+
+/// Time ordered storage for trace events.
+///
+/// Events are kept in a list of sorted chunks. Samples almost always arrive in order
+/// so the common case is an append to the last chunk. A late sample only shifts the
+/// tail of the one chunk it lands in instead of the whole capture.
+///
+/// Each chunk is stored column-wise and frames are interned in a StackTable, so a
+/// sample only costs a timestamp, a few ids and a stack id.
+///
+/// Chunks are shared copy-on-write and the stack table only shares blocks it appends to,
+/// so copying a store is cheap and gives a consistent snapshot that can be read without holding the trace lock.
+class TraceEventStore {
+  struct Chunk {
+    std::vector<uint64_t> nanoseconds;
+    std::vector<uint64_t> buildIds;
+    std::vector<uint64_t> eventIndices;
+    std::vector<uint64_t> changeIndices;
+    std::vector<uint32_t> stackIds;
+    uint64_t maxChangeIndex { 0 };
+
+    [[nodiscard]] size_t size() const {
+      return nanoseconds.size();
+    }
+
+    void reserve(size_t count);
+
+    void insert(size_t index, const TraceEvent &event, uint32_t stackId);
+
+    void moveTail(size_t index, Chunk &into);
+  };
+
+public:
+  /// Chunks are started at this size and split in half once they reach double this size.
+  static constexpr size_t kChunkCapacity = 4096;
+
+  class const_iterator {
+    friend TraceEventStore;
+
+    const TraceEventStore *store { nullptr };
+    size_t chunkIndex { 0 };
+    size_t eventIndex { 0 };
+
+    const_iterator(const TraceEventStore *store, size_t chunkIndex, size_t eventIndex)
+            : store(store), chunkIndex(chunkIndex), eventIndex(eventIndex) {}
+
+    struct ArrowProxy {
+      TraceEvent event;
+
+      const TraceEvent *operator->() const {
+        return &event;
+      }
+    };
+
+  public:
+    using iterator_category = std::forward_iterator_tag;
+    using value_type = TraceEvent;
+    using difference_type = std::ptrdiff_t;
+    using pointer = ArrowProxy;
+    using reference = TraceEvent;
+
+    const_iterator() = default;
+
+    reference operator*() const {
+      return store->eventAt(chunkIndex, eventIndex);
+    }
+
+    pointer operator->() const {
+      return ArrowProxy { **this };
+    }
+
+    const_iterator &operator++() {
+      if (++eventIndex == store->chunks[chunkIndex]->size()) {
+        chunkIndex++;
+        eventIndex = 0;
+      }
+      return *this;
+    }
+
+    const_iterator operator++(int) {
+      auto copy = *this;
+      ++*this;
+      return copy;
+    }
+
+    bool operator==(const const_iterator &other) const {
+      return chunkIndex == other.chunkIndex && eventIndex == other.eventIndex;
+    }
+
+    bool operator!=(const const_iterator &other) const {
+      return !(*this == other);
+    }
+  };
+
+private:
+  // never contains an empty chunk. Chunks may be shared with snapshots, see mutableChunk().
+  std::vector<std::shared_ptr<Chunk>> chunks;
+  StackTable stacks;
+  size_t eventCount { 0 };
+
+public:
+  /// Copies the event into the store, interning its frames.
+  void insert(const TraceEvent &event);
+
+  /// Inserts every event of the batch, the i-th event gets change index firstChangeIndex + i.
+  void insertBatch(const TraceBatch &batch, uint64_t firstChangeIndex);
+
+  void clear();
+
+  [[nodiscard]] size_t size() const {
+    return eventCount;
+  }
+
+  [[nodiscard]] bool empty() const {
+    return eventCount == 0;
+  }
+
+  [[nodiscard]] const_iterator begin() const {
+    return const_iterator(this, 0, 0);
+  }
+
+  [[nodiscard]] const_iterator end() const {
+    return const_iterator(this, chunks.size(), 0);
+  }
+
+  [[nodiscard]] const StackTable &stackTable() const {
+    return stacks;
+  }
+
+  /// A read-only copy of the store as it is now. Only the chunk and stack block lists are copied,
+  /// the chunks themselves are shared until this store modifies them.
+  [[nodiscard]] TraceEventStore snapshot() const {
+    return *this;
+  }
+
+  [[nodiscard]] TraceEvent front() const {
+    return eventAt(0, 0);
+  }
+
+  [[nodiscard]] TraceEvent back() const {
+    return eventAt(chunks.size() - 1, chunks.back()->size() - 1);
+  }
+
+  /// First event with a timestamp >= nanoseconds.
+  [[nodiscard]] const_iterator lowerBound(uint64_t nanoseconds) const;
+
+  [[nodiscard]] size_t chunkCount() const {
+    return chunks.size();
+  }
+
+  /// Calls func for every event of chunks [firstChunk, lastChunk) taken between start and end
+  /// (inclusive), in order. Lets a scan over the store be split up between threads.
+  template<typename Func>
+  void forEachInChunks(size_t firstChunk, size_t lastChunk, uint64_t start, uint64_t end, Func func) const {
+    for (size_t chunkIndex = firstChunk; chunkIndex < lastChunk; chunkIndex++) {
+      auto &chunk = *chunks[chunkIndex];
+      if (chunk.nanoseconds.front() > end || chunk.nanoseconds.back() < start)
+        continue;
+
+      auto first = std::lower_bound(chunk.nanoseconds.begin(), chunk.nanoseconds.end(), start);
+      for (auto i = static_cast<size_t>(first - chunk.nanoseconds.begin()); i < chunk.size(); i++) {
+        if (chunk.nanoseconds[i] > end)
+          break;
+        func(eventAt(chunkIndex, i));
+      }
+    }
+  }
+
+  /// Calls func for every event with a change_index greater than changeIndex.
+  /// Chunks that have not been touched since then are skipped entirely.
+  template<typename Func>
+  void forEachChangedSince(uint64_t changeIndex, Func func) const {
+    for (size_t chunkIndex = 0; chunkIndex < chunks.size(); chunkIndex++) {
+      auto &chunk = *chunks[chunkIndex];
+      if (chunk.maxChangeIndex <= changeIndex)
+        continue;
+
+      for (size_t i = 0; i < chunk.size(); i++) {
+        if (chunk.changeIndices[i] > changeIndex)
+          func(eventAt(chunkIndex, i));
+      }
+    }
+  }
+
+private:
+  [[nodiscard]] TraceEvent eventAt(size_t chunkIndex, size_t index) const {
+    auto &chunk = *chunks[chunkIndex];
+    return TraceEvent {
+            chunk.nanoseconds[index],
+            chunk.buildIds[index],
+            chunk.eventIndices[index],
+            chunk.changeIndices[index],
+            chunk.stackIds[index],
+            stacks.get(chunk.stackIds[index]),
+    };
+  }
+
+  /// Returns chunk index for writing, copying it first if a snapshot still shares it.
+  Chunk &mutableChunk(size_t index);
+
+  void splitChunk(size_t index);
+};
+
+
+#endif //TRACEVIEWER2_TRACEEVENTSTORE_H
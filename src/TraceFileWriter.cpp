@@ -0,0 +1,73 @@
+//
+// Created by Will Gulian on 1/12/21.
+//
+
+#include <capnp/message.h>
+#include <capnp/serialize.h>
+#include <capnp/serialize-packed.h>
+
+#include "TraceFileWriter.h"
+#include "schema/tracestreaming.capnp.h"
+
+TraceFileWriter::TraceFileWriter(kj::OutputStream &stream, TraceFileFormat format) : stream(stream), format(format) {
+  switch (format) {
+    case TraceFileFormat::Packed:
+      stream.write(kPackedTraceMagic, sizeof(kPackedTraceMagic));
+      break;
+    case TraceFileFormat::Mapped:
+      stream.write(kMappedTraceMagic, sizeof(kMappedTraceMagic));
+      break;
+  }
+}
+
+void TraceFileWriter::add(const TraceEvent &event) {
+  auto &batch = pending[event.build_id];
+
+  batch.beginEvent(event.nanoseconds, event.build_id, event.event_index);
+  for (auto &frame : event.frames) {
+    batch.addFrame(frame.pc);
+  }
+
+  if (batch.size() >= kGroupSize) {
+    writeGroup(event.build_id, batch);
+  }
+}
+
+void TraceFileWriter::flush() {
+  for (auto &[buildId, batch] : pending) {
+    if (!batch.empty())
+      writeGroup(buildId, batch);
+  }
+}
+
+void TraceFileWriter::writeGroup(uint64_t buildId, TraceBatch &batch) {
+  ::capnp::MallocMessageBuilder message;
+
+  auto cGroup = message.initRoot<net_trace::TraceGroup>();
+  cGroup.setBuildId(buildId);
+
+  auto cEvents = cGroup.initEvents(batch.size());
+  for (size_t eventIdx = 0; eventIdx < batch.size(); eventIdx++) {
+    auto event = batch.eventAt(eventIdx);
+    auto cEvent = cEvents[eventIdx];
+
+    cEvent.setEventIndex(event.event_index);
+    cEvent.setTimestamp(event.nanoseconds);
+
+    auto cFrames = cEvent.initFrames(event.frames.size());
+    for (size_t frameIdx = 0; frameIdx < event.frames.size(); frameIdx++) {
+      cFrames[frameIdx].setPc(event.frames[frameIdx].pc);
+    }
+  }
+
+  switch (format) {
+    case TraceFileFormat::Packed:
+      ::capnp::writePackedMessage(stream, message);
+      break;
+    case TraceFileFormat::Mapped:
+      ::capnp::writeMessage(stream, message);
+      break;
+  }
+
+  batch.clear();
+}
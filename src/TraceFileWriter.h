@@ -0,0 +1,55 @@
+//
+// Created by Will Gulian on 1/12/21.
+//
+
+#ifndef TRACEVIEWER2_TRACEFILEWRITER_H
+#define TRACEVIEWER2_TRACEFILEWRITER_H
+
+#include <map>
+
+#include <kj/io.h>
+
+#include "TraceEventStore.h"
+
+enum class TraceFileFormat {
+  /// Packed Cap'n Proto, smallest on disk but has to be unpacked when loading.
+  Packed,
+  /// Unpacked Cap'n Proto, read in place from a memory mapping.
+  Mapped,
+};
+
+/// Marks a stream of packed TraceGroup messages. Files without a magic are a single packed SavedTraces.
+static constexpr char kPackedTraceMagic[8] = {'T', 'R', 'A', 'C', 'E', 'P', 'A', 'K'};
+/// Marks a stream of unpacked TraceGroup messages. The magic is one word long so the
+/// messages after it stay word aligned in the mapping.
+static constexpr char kMappedTraceMagic[8] = {'T', 'R', 'A', 'C', 'E', 'M', 'A', 'P'};
+
+/// Writes trace events as a magic followed by a sequence of self-contained TraceGroup messages.
+///
+/// Events are buffered per build and written out as a group once kGroupSize of them are
+/// pending, so memory use does not grow with the capture. As groups stand on their own
+/// the writer can be fed incrementally, e.g. by a flight recorder that keeps appending.
+class TraceFileWriter {
+  kj::OutputStream &stream;
+  TraceFileFormat format;
+  // ordered so files come out the same every time.
+  std::map<uint64_t, TraceBatch> pending;
+
+public:
+  static constexpr size_t kGroupSize = 4096;
+
+  /// Writes the format's magic straight away.
+  TraceFileWriter(kj::OutputStream &stream, TraceFileFormat format);
+
+  /// Copies the event, its frames do not need to outlive the call.
+  void add(const TraceEvent &event);
+
+  /// Writes out every pending event. Must be called before the stream is closed.
+  void flush();
+
+private:
+  void writeGroup(uint64_t buildId, TraceBatch &batch);
+};
+
+
+#endif //TRACEVIEWER2_TRACEFILEWRITER_H
@@ -81,13 +81,35 @@ void CustomTraceDialog::updateSymbols() {
 
   auto debugTable = getDebugTable();
   auto info = debugTable->loadedFiles.find(id);
+  if (info == debugTable->loadedFiles.end()) {
+    functionsEdit->setPlainText(QString());
+    return;
+  }
 
   auto lines = addressesEdit->toPlainText().split(reNewline);
+
+  std::vector<uint64_t> addresses;
+  std::vector<bool> validLines;
   for (auto &line : lines) {
     auto [address, valid] = parseInt(line);
+    validLines.push_back(valid);
+    if (valid)
+      addresses.push_back(address);
+  }
+
+  auto resolved = info->second.resolveBatch(addresses);
+
+  size_t addressIndex = 0;
+  for (bool valid : validLines) {
     if (valid) {
-      auto [symbol, _] = info->second.symbolicate(address);
-      result += symbol;
+      auto &func = resolved[addressIndex];
+      if (func.function) {
+        result += toQString(func.function->full_name);
+      } else {
+        result += "0x";
+        result += QString::number(addresses[addressIndex], 16);
+      }
+      addressIndex++;
     }
     result += "\n";
   }
@@ -2,10 +2,13 @@
 // Created by Will Gulian on 12/19/20.
 //
 
+#include <algorithm>
+#include <cmath>
 #include <iostream>
 
 #include <QMouseEvent>
 #include <QPainter>
+#include <QWheelEvent>
 
 #include "TraceTimeline.h"
 
@@ -21,7 +24,11 @@ void TraceTimeline::traceDataChanged() {
 
 void TraceTimeline::paintEvent(QPaintEvent *event) {
 
-  traceData->generateTimeline(timeline, width());
+  if (zoomed) {
+    traceData->generateTimeline(timeline, width(), viewStart, viewEnd);
+  } else {
+    traceData->generateTimeline(timeline, width());
+  }
 
   int maxCount = 0;
   for (auto col : timeline.columns) {
@@ -35,14 +42,19 @@ void TraceTimeline::paintEvent(QPaintEvent *event) {
   p.drawRect(QRect(0, 0, width(), height()));
 
   if (mousePressEntry.valid && mouseReleaseEntry.valid && timeline.valid()) {
-    auto oldTime = std::min(mousePressEntry.oldest_timestamp, mouseReleaseEntry.oldest_timestamp);
-    auto newTime = std::max(mousePressEntry.newest_timestamp, mouseReleaseEntry.newest_timestamp);
-
-    auto oldX = timeline.timeToIndex(oldTime);
-    auto newX = timeline.timeToIndex(newTime);
-
-    p.setBrush(palette().alternateBase());
-    p.drawRect(QRect(oldX, 0, newX - oldX + 1, height()));
+    // the selection may be partially or entirely out of view.
+    auto oldTime = std::max(std::min(mousePressEntry.oldest_timestamp, mouseReleaseEntry.oldest_timestamp),
+                            timeline.oldest_timestamp);
+    auto newTime = std::min(std::max(mousePressEntry.newest_timestamp, mouseReleaseEntry.newest_timestamp),
+                            timeline.newest_timestamp);
+
+    if (oldTime <= newTime) {
+      auto oldX = timeline.timeToIndex(oldTime);
+      auto newX = timeline.timeToIndex(newTime);
+
+      p.setBrush(palette().alternateBase());
+      p.drawRect(QRect(oldX, 0, newX - oldX + 1, height()));
+    }
   }
 
   p.setBrush(palette().text());
@@ -55,31 +67,93 @@ void TraceTimeline::paintEvent(QPaintEvent *event) {
 
 }
 
+TimelineEntry TraceTimeline::entryAt(int x) {
+  TimelineEntry entry{};
+  if (!timeline.valid() || timeline.columns.empty())
+    return entry;
+
+  x = std::clamp(x, 0, static_cast<int>(timeline.columns.size()) - 1);
+
+  auto [t1, t2] = timeline.indexToTime(x);
+  entry.oldest_timestamp = t1;
+  entry.newest_timestamp = t2;
+  entry.valid = true;
+  return entry;
+}
+
 void TraceTimeline::mousePressEvent(QMouseEvent *event) {
-  std::cout << "press\n";
   event->accept();
-  auto x = event->pos().x();
 
-  mousePressEntry = TimelineEntry{};
-  auto [t1, t2] = timeline.indexToTime(x);
-  mousePressEntry.oldest_timestamp = t1;
-  mousePressEntry.newest_timestamp = t2;
-  mousePressEntry.valid = true;
+  // Start a new selection, it is extended while dragging.
+  mousePressEntry = entryAt(event->pos().x());
+  mouseReleaseEntry = mousePressEntry;
+  repaint();
+}
 
-  mouseReleaseEntry = TimelineEntry{};
+void TraceTimeline::mouseMoveEvent(QMouseEvent *event) {
+  event->accept();
+  if (!mousePressEntry.valid)
+    return;
+
+  mouseReleaseEntry = entryAt(event->pos().x());
   repaint();
 }
 
 void TraceTimeline::mouseReleaseEvent(QMouseEvent *event) {
-  std::cout << "release\n";
   event->accept();
-  auto x = event->pos().x();
+  if (!mousePressEntry.valid)
+    return;
+
+  mouseReleaseEntry = entryAt(event->pos().x());
+  repaint();
+
+  if (mouseReleaseEntry.valid) {
+    selectionChanged(std::min(mousePressEntry.oldest_timestamp, mouseReleaseEntry.oldest_timestamp),
+                     std::max(mousePressEntry.newest_timestamp, mouseReleaseEntry.newest_timestamp));
+  }
+}
+
+void TraceTimeline::mouseDoubleClickEvent(QMouseEvent *event) {
+  event->accept();
 
+  zoomed = false;
+  mousePressEntry = TimelineEntry{};
   mouseReleaseEntry = TimelineEntry{};
-  auto [t1, t2] = timeline.indexToTime(x);
-  mouseReleaseEntry.oldest_timestamp = t1;
-  mouseReleaseEntry.newest_timestamp = t2;
-  mouseReleaseEntry.valid = true;
+  repaint();
+
+  selectionChanged(0, std::numeric_limits<uint64_t>::max());
+}
+
+void TraceTimeline::wheelEvent(QWheelEvent *event) {
+  event->accept();
+
+  uint64_t captureStart, captureEnd;
+  if (!timeline.valid() || width() <= 0 || !traceData->histogram.range(captureStart, captureEnd))
+    return;
+
+  // Plenty of precision for the fractions of a range this works with.
+  auto captureSpan = static_cast<double>(captureEnd - captureStart) + 1;
+  auto span = static_cast<double>(timeline.newest_timestamp - timeline.oldest_timestamp) + 1;
+  auto start = static_cast<double>(timeline.oldest_timestamp - captureStart);
+
+  auto delta = event->angleDelta();
+  if (delta.x() != 0 || (event->modifiers() & Qt::ShiftModifier)) {
+    // Pan by a tenth of the visible range per notch.
+    auto notches = (delta.x() != 0 ? delta.x() : delta.y()) / 120.0;
+    start -= notches * span / 10;
+  } else {
+    // Zoom around the time under the cursor, but never past one nanosecond per column.
+    auto notches = delta.y() / 120.0;
+    auto anchor = start + span * event->position().x() / width();
+    auto newSpan = std::min(std::max(span * std::pow(0.8, notches), static_cast<double>(width())), captureSpan);
+    start = anchor - (anchor - start) * newSpan / span;
+    span = newSpan;
+  }
+
+  start = std::clamp(start, 0.0, captureSpan - span);
 
+  zoomed = span < captureSpan;
+  viewStart = captureStart + static_cast<uint64_t>(start);
+  viewEnd = viewStart + static_cast<uint64_t>(span) - 1;
   repaint();
 }
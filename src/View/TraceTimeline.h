@@ -16,6 +16,11 @@ Q_OBJECT
   std::shared_ptr<TraceData> traceData;
   Timeline timeline{};
 
+  // Visible time range (inclusive) while zoomed in, otherwise the whole capture is shown.
+  bool zoomed { false };
+  uint64_t viewStart { 0 };
+  uint64_t viewEnd { 0 };
+
   TimelineEntry mousePressEntry{};
   TimelineEntry mouseReleaseEntry{};
 
@@ -24,6 +29,10 @@ public:
 
   ~TraceTimeline() override = default;
 
+signals:
+  /// A time range (inclusive) was selected by dragging. Clearing the selection selects everything.
+  void selectionChanged(uint64_t start, uint64_t end);
+
 public slots:
   void traceDataChanged();
 
@@ -32,8 +41,20 @@ protected:
 
   void mousePressEvent(QMouseEvent *event) override;
 
+  void mouseMoveEvent(QMouseEvent *event) override;
+
   void mouseReleaseEvent(QMouseEvent *event) override;
 
+  /// Resets the zoom and clears the selection.
+  void mouseDoubleClickEvent(QMouseEvent *event) override;
+
+  /// Scrolling zooms around the cursor, horizontal or shift-scrolling pans.
+  void wheelEvent(QWheelEvent *event) override;
+
+private:
+  /// Time range covered by the column under x, nothing if no timeline has been drawn.
+  TimelineEntry entryAt(int x);
+
 };
 
 
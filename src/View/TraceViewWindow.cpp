@@ -70,6 +70,8 @@ TraceViewWindow::TraceViewWindow(std::shared_ptr<TraceData> trace_data,
 
   connect(treeWidget->selectionModel(), &QItemSelectionModel::currentChanged, this, &TraceViewWindow::traceSelectionChanged);
 
+  connect(traceTimeline, &TraceTimeline::selectionChanged, traceModel, &TraceHierarchyModel::setTimeRange);
+
   connect(asmModel, &DisassemblyInlinesModel::modelReset, this, &TraceViewWindow::asmDataLoaded);
 
   connect(fileWatcher, &QFileSystemWatcher::fileChanged, this, &TraceViewWindow::onFileChanged);
@@ -77,6 +79,11 @@ TraceViewWindow::TraceViewWindow(std::shared_ptr<TraceData> trace_data,
   connect(this, &TraceViewWindow::doLoadFile, fileLoader, &FileLoader::loadFile);
   connect(fileLoader, &FileLoader::fileLoaded, this, &TraceViewWindow::fileLoaded);
 
+  // Lazily loaded files gain symbols in the background, rebuild the tree once they do.
+  this->debugTable->setOnUnitsLoaded([this](uint64_t) {
+    QMetaObject::invokeMethod(traceModel, [this] { traceModel->symbolsChanged(); }, Qt::QueuedConnection);
+  });
+
 
   auto *mainLayout = new QGridLayout;
 
@@ -91,6 +98,11 @@ TraceViewWindow::TraceViewWindow(std::shared_ptr<TraceData> trace_data,
   createMenus();
 }
 
+TraceViewWindow::~TraceViewWindow() {
+  // the debug table outlives the window, its loader thread must not call back into it.
+  debugTable->setOnUnitsLoaded(nullptr);
+}
+
 void TraceViewWindow::onFileChanged(const QString &path) {
   std::cout << "file changed: " << path.toStdString() << std::endl;
 
@@ -127,6 +139,10 @@ void TraceViewWindow::createMenus() {
   traceShowInlinedFuncsAct->setCheckable(true);
   traceShowInlinedFuncsAct->setChecked(traceModel->getShowInlineFuncs());
 
+  lazySymbolsAct = new QAction("Lazy Symbol Loading", this);
+  lazySymbolsAct->setCheckable(true);
+  lazySymbolsAct->setChecked(debugTable->lazyLoad);
+
   customTraceWindowAct = new QAction("Custom Trace", this);
   customTraceWindowAct->setShortcut(QKeySequence("Ctrl+9"));
 
@@ -146,6 +162,7 @@ void TraceViewWindow::createMenus() {
   }
 
   viewMenu->addAction(traceShowInlinedFuncsAct);
+  viewMenu->addAction(lazySymbolsAct);
 
   viewMenu->addSeparator();
 
@@ -161,6 +178,7 @@ void TraceViewWindow::createMenus() {
   connect(traceOrderBottomUpAct, &QAction::triggered, this, &TraceViewWindow::tracesBottomUpTriggered);
   connect(traceOrderTopFunctionsAct, &QAction::triggered, this, &TraceViewWindow::tracesTopFunctionsTriggered);
   connect(traceShowInlinedFuncsAct, &QAction::triggered, this, &TraceViewWindow::showInlineFuncsTriggered);
+  connect(lazySymbolsAct, &QAction::triggered, this, &TraceViewWindow::lazySymbolsTriggered);
 
   connect(customTraceWindowAct, &QAction::triggered, this, &TraceViewWindow::openCustomTraceDialog);
 
@@ -187,6 +205,11 @@ void TraceViewWindow::showInlineFuncsTriggered() {
   traceModel->setShowInlineFuncs(traceShowInlinedFuncsAct->isChecked());
 }
 
+void TraceViewWindow::lazySymbolsTriggered() {
+  // only affects files loaded from now on.
+  debugTable->lazyLoad = lazySymbolsAct->isChecked();
+}
+
 void TraceViewWindow::fileLoaded(QString path) {
   std::cout << "reloaded " << path.toStdString() << std::endl;
 
@@ -210,19 +233,24 @@ void TraceViewWindow::addFile(const QString &path) {
 
 void TraceViewWindow::openExportTracesDialog() {
 
+  const QString packedFilter("Traces (*.traces)");
+  const QString mappedFilter("Mapped Traces, larger but fast to open (*.mtraces)");
+
+  QString selectedFilter;
   auto fileName = QFileDialog::getSaveFileName(
-          this, "Export Traces", "/Users/will", "Traces (*.traces)");
+          this, "Export Traces", "/Users/will", packedFilter + ";;" + mappedFilter, &selectedFilter);
 
   std::cout << "export file: " << fileName.toStdString() << "\n";
 
-  trace_data->exportToFile(fileName);
+  auto format = selectedFilter == mappedFilter ? TraceFileFormat::Mapped : TraceFileFormat::Packed;
+  trace_data->exportToFile(fileName, format);
 
 }
 
 void TraceViewWindow::openImportTracesDialog() {
 
   auto fileName = QFileDialog::getOpenFileName(
-          this, "Import Traces", "/Users/will/traces", "Traces (*.traces)");
+          this, "Import Traces", "/Users/will/traces", "Traces (*.traces *.mtraces)");
 
   std::cout << "import file: " << fileName.toStdString() << "\n";
 
@@ -251,16 +279,16 @@ void TraceViewWindow::traceSelectionChanged(const QModelIndex &current, const QM
       return;
     }
 
-    auto addrCounts = traceModel->getAddrCounts(sourceIndex);
-
-    asmModel->disassembleRegion(*func2, &addrCounts);
-    std::cout << "disassembled ranges" << std::endl;
+    traceModel->requestAddrCounts(sourceIndex, [this, func2](const std::unordered_map<uint64_t, size_t> &addrCounts) {
+      asmModel->disassembleRegion(*func2, &addrCounts);
+      std::cout << "disassembled ranges" << std::endl;
+    });
   }
 
-  if (auto *func2 = dynamic_cast<InlinedFunctionInfo *>(func); func2 != nullptr) {
+  if (auto *func2 = dynamic_cast<InlinedFunctionInfo *>(func); func2 != nullptr && func2->getConcreteFunction()) {
     std::cout << "concrete func ptr = 0x" << std::hex << (uintptr_t)(func2->getConcreteFunction()) << std::dec << std::endl;
     std::cout << "die offset = 0x" << std::hex << (uintptr_t)(func2->getConcreteFunction()->die_offset) << std::dec << std::endl;
-    std::cout << "link name = " << (func2->getConcreteFunction()->linkageName).toStdString() << std::endl;
+    std::cout << "link name = " << func2->getConcreteFunction()->linkageName << std::endl;
   }
 
 }
@@ -49,6 +49,7 @@ Q_OBJECT
   QAction *traceOrderBottomUpAct = nullptr;
   QAction *traceOrderTopFunctionsAct = nullptr;
   QAction *traceShowInlinedFuncsAct = nullptr;
+  QAction *lazySymbolsAct = nullptr;
   QAction *customTraceWindowAct = nullptr;
 
   uint64_t last_trace_change = 0;
@@ -59,6 +60,8 @@ public:
 
   explicit TraceViewWindow(std::shared_ptr<TraceData> trace_data, std::shared_ptr<DebugTable> debugTable);
 
+  ~TraceViewWindow() override;
+
   void addFile(const QString &path);
 
 signals:
@@ -78,6 +81,8 @@ private slots:
 
   void showInlineFuncsTriggered();
 
+  void lazySymbolsTriggered();
+
   void fileLoaded(QString path);
 
   void openCustomTraceDialog();